@@ -34,6 +34,14 @@ echo ::group::{release crash tests}
 for i in ./.current/crashtest_* ; do echo "Running $i"; $i; done
 echo ::endgroup::
 
+echo
+echo "=== RELEASE STRESS TEST, SIMULATED CLOCK ==="
+echo
+
+echo ::group::{release stress test}
+./.current/stress_lifetime_manager --runs=100
+echo ::endgroup::
+
 echo
 echo "=== MAKE DEBUG ==="
 echo
@@ -66,6 +74,14 @@ echo ::group::{debug crash tests}
 for i in ./.current_debug/crashtest_* ; do echo "Running $i"; $i; done
 echo ::endgroup::
 
+echo
+echo "=== DEBUG STRESS TEST, SIMULATED CLOCK ==="
+echo
+
+echo ::group::{debug stress test}
+./.current_debug/stress_lifetime_manager --runs=100
+echo ::endgroup::
+
 echo
 echo "=== DONE ==="
 echo
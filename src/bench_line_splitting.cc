@@ -0,0 +1,194 @@
+#include <cstdio>
+#include <iostream>
+#include <chrono>
+
+#include "popen2.h"
+#include "lib_c5t_lifetime_manager.h"
+#include "lib_c5t_line_splitter.h"
+#include "bricks/dflags/dflags.h"
+#include "bricks/strings/printf.h"
+
+DEFINE_uint32(lines, 1000000, "The number of lines each synthetic child emits.");
+DEFINE_uint32(runs, 10, "The number of in-memory splitting passes to average over.");
+
+// NOTE: Three synthetic children, in the spirit of the `seq` loop of `crashtest_4.cc`, just without sleeps.
+struct Scenario final {
+  char const* name;
+  std::string cmd;
+};
+
+static std::vector<Scenario> Scenarios(uint32_t n) {
+  std::string const N = current::ToString(n);
+  std::string const N_LONG = current::ToString(std::max(n / 100u, 1u));
+  return {{"short", "seq " + N},
+          {"long", "yes \"$(printf '%0999d' 0)\" | head -n " + N_LONG},
+          {"mixed", "seq " + N + " | awk '{ if ($1 % 10 == 0) printf \"%s %0500d\\r\\n\", $1, 0; else print $1 }'"}};
+}
+
+struct Stats final {
+  size_t lines = 0u;
+  size_t bytes = 0u;
+  void operator()(std::string_view s) {
+    ++lines;
+    bytes += s.length();
+  }
+};
+
+static std::string Rate(size_t bytes, std::chrono::microseconds dt) {
+  double const s = 1e-6 * std::max(int64_t(1), int64_t(dt.count()));
+  return current::strings::Printf("%8.3lfs, %8.1lf MB/s", s, 1e-6 * bytes / s);
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  LIFETIME_MANAGER_SET_LOGGER([](std::string const&) {});
+
+  std::cout << "Best newline scanner: " << current::lines::NewlineScannerName(current::lines::BestNewlineScanner())
+            << std::endl;
+
+  for (auto const& scenario : Scenarios(FLAGS_lines)) {
+    std::cout << std::endl << "=== " << scenario.name << ": " << scenario.cmd << std::endl;
+
+    // The current path: the child's output goes through `popen2()`, and each line is an `std::string` for `cb_line`.
+    Stats popen2_stats;
+    auto const t0 = current::time::Now();
+    LIFETIME_TRACKED_POPEN2(scenario.name, {"bash", "-c", scenario.cmd}, [&popen2_stats](std::string const& line) {
+      popen2_stats(line);
+    });
+    auto const t1 = current::time::Now();
+    std::cout << current::strings::Printf("%-30s", "popen2 + cb_line") << Rate(popen2_stats.bytes, t1 - t0) << ", "
+              << popen2_stats.lines << " lines" << std::endl;
+
+    // The raw output of the very same child, for the in-memory comparisons below, collected outside the timed runs.
+    std::string raw;
+    {
+      FILE* f = ::popen(scenario.cmd.c_str(), "r");
+      if (!f) {
+        std::cerr << "Can not `popen()`." << std::endl;
+        LIFETIME_MANAGER_EXIT(1);
+      }
+      char buffer[1 << 16];
+      size_t n;
+      while ((n = std::fread(buffer, 1u, sizeof(buffer), f)) > 0u) {
+        raw.append(buffer, n);
+      }
+      ::pclose(f);
+    }
+
+    // The new path: 64KB `read()`-s from the very same child into the reusable buffer.
+    Stats splitter_stats;
+    auto const t2 = current::time::Now();
+    {
+      FILE* f = ::popen(scenario.cmd.c_str(), "r");
+      if (!f) {
+        std::cerr << "Can not `popen()`." << std::endl;
+        LIFETIME_MANAGER_EXIT(1);
+      }
+      current::lines::LineSplitter splitter;
+      while (true) {
+        char* const dst = splitter.WritableBegin();
+        ssize_t const n = ::read(fileno(f), dst, splitter.WritableSize());
+        if (n <= 0) {
+          break;
+        }
+        splitter.Commit(static_cast<size_t>(n), splitter_stats);
+      }
+      splitter.Flush(splitter_stats);
+      ::pclose(f);
+    }
+    auto const t3 = current::time::Now();
+    std::cout << current::strings::Printf("%-30s", "read + LineSplitter") << Rate(splitter_stats.bytes, t3 - t2)
+              << ", " << splitter_stats.lines << " lines" << std::endl;
+
+    // The same through `ReadLinesFromFD()`, the `cb_line`-style reader over `LineSplitter::ReadAll()`.
+    // It is not what `LIFETIME_TRACKED_POPEN2` uses, as `popen2()` does its own reading.
+    Stats read_all_stats;
+    auto const t6 = current::time::Now();
+    {
+      FILE* f = ::popen(scenario.cmd.c_str(), "r");
+      if (!f) {
+        std::cerr << "Can not `popen()`." << std::endl;
+        LIFETIME_MANAGER_EXIT(1);
+      }
+      current::lines::ReadLinesFromFD(fileno(f), [&read_all_stats](std::string const& line) { read_all_stats(line); });
+      ::pclose(f);
+    }
+    auto const t7 = current::time::Now();
+    std::cout << current::strings::Printf("%-30s", "ReadLinesFromFD") << Rate(read_all_stats.bytes, t7 - t6) << ", "
+              << read_all_stats.lines << " lines" << std::endl;
+
+    // And through `ReadAll()` over a regular file, where each `read()` fills all it is asked to, so that the buffer
+    // deterministically gets full, with a small read size to cross many buffer boundaries.
+    Stats file_stats;
+    {
+      FILE* f = std::tmpfile();
+      if (!f || std::fwrite(raw.data(), 1u, raw.length(), f) != raw.length() || std::fflush(f)) {
+        std::cerr << "Can not write a temporary file." << std::endl;
+        LIFETIME_MANAGER_EXIT(1);
+      }
+      std::rewind(f);
+      current::lines::LineSplitter splitter(4096u);
+      splitter.ReadAll(fileno(f), file_stats);
+      std::fclose(f);
+    }
+
+    // All of them must see exactly what the in-memory pass over the very same bytes sees.
+    {
+      Stats reference;
+      current::lines::LineSplitter splitter;
+      splitter.Feed(raw.data(), raw.length(), reference);
+      splitter.Flush(reference);
+      for (auto const& [name, stats] : {std::make_pair("read + LineSplitter", splitter_stats),
+                                        std::make_pair("ReadLinesFromFD", read_all_stats),
+                                        std::make_pair("ReadAll from a file", file_stats)}) {
+        if (stats.lines != reference.lines || stats.bytes != reference.bytes) {
+          std::cerr << "MISMATCH: " << name << " saw " << stats.lines << " lines and " << stats.bytes
+                    << " bytes, expected " << reference.lines << " lines and " << reference.bytes << " bytes."
+                    << std::endl;
+          LIFETIME_MANAGER_EXIT(1);
+        }
+      }
+    }
+
+    // In-memory, to isolate the CPU cost from the cost of running the child.
+    // The "per-byte" baseline appends char by char into one reused `std::string`, as reading a pipe naively does.
+    {
+      Stats stats;
+      auto const t4 = current::time::Now();
+      for (uint32_t run = 0; run < FLAGS_runs; ++run) {
+        std::string line;
+        for (char c : raw) {
+          if (c == '\n') {
+            stats(line);
+            line.clear();
+          } else {
+            line += c;
+          }
+        }
+        if (!line.empty()) {
+          stats(line);
+        }
+      }
+      auto const t5 = current::time::Now();
+      std::cout << current::strings::Printf("%-30s", "in-memory per-byte") << Rate(raw.length() * FLAGS_runs, t5 - t4)
+                << std::endl;
+    }
+    for (auto kind : {current::lines::NewlineScannerKind::Scalar,
+                      current::lines::NewlineScannerKind::SSE2,
+                      current::lines::NewlineScannerKind::AVX2}) {
+      if (!current::lines::NewlineScannerSupported(kind)) {
+        continue;
+      }
+      Stats stats;
+      auto const t4 = current::time::Now();
+      for (uint32_t run = 0; run < FLAGS_runs; ++run) {
+        current::lines::LineSplitter splitter(current::lines::LineSplitter::kDefaultReadSize, kind);
+        splitter.Feed(raw.data(), raw.length(), stats);
+        splitter.Flush(stats);
+      }
+      auto const t5 = current::time::Now();
+      std::cout << current::strings::Printf("in-memory LineSplitter %-7s", current::lines::NewlineScannerName(kind))
+                << Rate(raw.length() * FLAGS_runs, t5 - t4) << std::endl;
+    }
+  }
+}
@@ -6,8 +6,8 @@
 
 int main() {
   LIFETIME_MANAGER_SET_LOGGER([](std::string const& s) { std::cerr << "MGR: " << s << std::endl; });
-  LIFETIME_TRACKED_THREAD("sleep(0.1s)", []() { std::this_thread::sleep_for(std::chrono::milliseconds(100)); });
-  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  LIFETIME_TRACKED_THREAD("sleep(0.1s)", []() { LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(100)); });
+  LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(250));
   LIFETIME_MANAGER_EXIT(0);
   std::cerr << "should not see this." << std::endl;
 }
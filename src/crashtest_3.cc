@@ -11,7 +11,7 @@ int main() {
     LIFETIME_TRACKED_POPEN2(
         cmd, {"bash", "-c", cmd}, [](std::string const& line) { std::cerr << "bash: " << line << std::endl; });
   });
-  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(250));
   LIFETIME_MANAGER_EXIT(0);
   std::cerr << "should not see this." << std::endl;
 }
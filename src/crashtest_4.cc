@@ -10,8 +10,8 @@ int main() {
     auto const cmd = "for i in $(seq 50); do echo $i; sleep 0.1; done";
     LIFETIME_TRACKED_POPEN2(
         cmd, {"bash", "-c", cmd}, [](std::string const& line) { std::cerr << "bash: " << line << std::endl; });
-    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(30));
   });
-  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(500));
   std::cerr << "natural, organic exit." << std::endl;  // Delibrately no `LIFETIME_MANAGER_EXIT(0)`.
 }
@@ -0,0 +1,14 @@
+#include <iostream>
+#include <chrono>
+
+#include "popen2.h"
+#include "lib_c5t_lifetime_manager.h"
+
+int main() {
+  LIFETIME_MANAGER_SET_LOGGER([](std::string const& s) { std::cerr << "MGR: " << s << std::endl; });
+  LIFETIME_MANAGER_HANDLE_SIGNALS(LifetimeSignalsConfig().On(SIGTERM, 0));
+  LIFETIME_TRACKED_THREAD("cooperative sleep(10s)", []() { LIFETIME_SLEEP_FOR(std::chrono::seconds(10)); });
+  LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(100));
+  ::kill(::getpid(), SIGTERM);
+  LIFETIME_MANAGER_SLEEP_UNTIL_EXIT();
+}
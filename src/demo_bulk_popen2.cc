@@ -0,0 +1,49 @@
+#include <iostream>
+#include <chrono>
+
+#include "popen2.h"
+#include "lib_c5t_lifetime_manager.h"
+#include "lib_c5t_bulk_popen2.h"
+#include "bricks/dflags/dflags.h"
+
+DEFINE_uint32(inputs, 20, "The number of inputs to run the command over.");
+DEFINE_uint32(parallelism, 4, "The number of children to keep running at once.");
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  LIFETIME_MANAGER_SET_LOGGER([](std::string const& s) { std::cerr << "MGR: " << s << std::endl; });
+
+  std::vector<std::string> inputs;
+  for (uint32_t i = 1u; i <= FLAGS_inputs; ++i) {
+    inputs.push_back(current::ToString(i));
+  }
+  // A random delay per input, so that the order of completion differs from the order of the inputs.
+  std::vector<std::string> const cmd = {"bash", "-c", "sleep 0.0$((RANDOM % 10)); echo $(( {} * {} ))"};
+
+  LIFETIME_TRACKED_THREAD("progress reporter", []() {
+    if (LIFETIME_SLEEP_FOR(std::chrono::milliseconds(100))) {
+      std::cout << "in progress:" << std::endl;
+      LIFETIME_TRACKED_DEBUG_DUMP();
+    }
+  });
+
+  for (auto order : {BulkPopen2Order::Completion, BulkPopen2Order::Input}) {
+    BulkPopen2Config config;
+    config.parallelism = FLAGS_parallelism;
+    config.order = order;
+    std::string const name = order == BulkPopen2Order::Input ? "squares in input order" : "squares as completed";
+    std::cout << name << ":" << std::endl;
+    BulkPopen2Stats const stats = LIFETIME_BULK_POPEN2(
+        name,
+        cmd,
+        inputs,
+        [](BulkPopen2Result&& r) {
+          std::cout << "  #" << r.index << ' ' << r.input << "^2 = " << (r.lines.empty() ? "?" : r.lines.front())
+                    << (r.killed ? " (killed)" : "") << std::endl;
+        },
+        config);
+    std::cout << name << ": " << stats.ToString() << std::endl;
+  }
+
+  LIFETIME_MANAGER_EXIT(0);
+}
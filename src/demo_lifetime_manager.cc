@@ -40,7 +40,7 @@ struct SemiCooperativeSlowlyDeletingObject final {
 
   ~SemiCooperativeSlowlyDeletingObject() {
     ThreadSafeLog("Deleting the SemiCooperativeSlowlyDeletingObject.");
-    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(250));
     ThreadSafeLog("SemiCooperativeSlowlyDeletingObject deleted.");
   }
 
@@ -54,7 +54,7 @@ struct NonCooperativeSlowlyDeletingObject final {
   ~NonCooperativeSlowlyDeletingObject() {
     ThreadSafeLog("Deleting the NonCooperativeSlowlyDeletingObject.");
     // 60 seconds is beyond the reasonable graceful shutdown wait time.
-    std::this_thread::sleep_for(std::chrono::seconds(60));
+    LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::seconds(60));
     ThreadSafeLog("[ SHOULD NOT SEE THIS ] NonCooperativeSlowlyDeletingObject deleted.");
   }
 
@@ -69,7 +69,7 @@ int main(int argc, char** argv) {
 
   auto const SmallDelay = []() {
     // Just so that the terminal output comes in predictable order, since there are `bash` invocations involved.
-    std::this_thread::sleep_for(std::chrono::milliseconds(3));
+    LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(3));
   };
 
   auto& o1 = LIFETIME_TRACKED_INSTANCE(CooperativeSlowlyDeletingObject, "super-cooperative instance", 42);
@@ -94,7 +94,8 @@ int main(int argc, char** argv) {
     bool truly_done = false;
     while (!truly_done) {
       ThreadSafeLog("long super-cooperative " + current::ToString(++i));
-      done.WaitFor(
+      LIFETIME_WAIT_FOR(
+          done,
           [&truly_done](bool b) {
             if (b) {
               truly_done = true;
@@ -115,12 +116,12 @@ int main(int argc, char** argv) {
     while (true) {
       if (LIFETIME_SHUTTING_DOWN) {
         ThreadSafeLog("long semi-cooperative wait before shutting down");
-        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(250));
         ThreadSafeLog("long semi-cooperative shutting down");
         break;
       } else {
         ThreadSafeLog("long semi-cooperative " + current::ToString(++i));
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(100));
       }
     }
   });
@@ -134,12 +135,12 @@ int main(int argc, char** argv) {
         if (LIFETIME_SHUTTING_DOWN) {
           ThreadSafeLog("long non-cooperative wait FOREVER=60s before shutting down");
           // 60 seconds is beyond the reasonable graceful shutdown wait time.
-          std::this_thread::sleep_for(std::chrono::seconds(60));
+          LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::seconds(60));
           ThreadSafeLog("long non-cooperative shutting down, but you will not see this =)");
           break;
         } else {
           ThreadSafeLog("long non-cooperative " + current::ToString(++i));
-          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::milliseconds(100));
         }
       }
     });
@@ -192,7 +193,7 @@ int main(int argc, char** argv) {
                                            t.description.c_str(),
                                            t.file_basename.c_str(),
                                            t.line_as_number,
-                                           1e-6 * (current::time::Now() - t.t_added).count()));
+                                           1e-6 * (LIFETIME_NOW() - t.t_added).count()));
   };
 
   ThreadSafeLog("");
@@ -201,7 +202,7 @@ int main(int argc, char** argv) {
   ThreadSafeLog("Sleeping for three seconds.");
   ThreadSafeLog("");
 
-  std::this_thread::sleep_for(std::chrono::seconds(3));
+  LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(std::chrono::seconds(3));
 
   ThreadSafeLog("");
   ThreadSafeLog("Sleep done, prior to terminating here is what is alive as of now.");
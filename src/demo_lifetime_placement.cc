@@ -0,0 +1,56 @@
+#include <iostream>
+#include <chrono>
+#include <fstream>
+
+#include "popen2.h"
+#include "lib_c5t_lifetime_manager.h"
+#include "lib_c5t_lifetime_placement.h"
+#include "bricks/dflags/dflags.h"
+
+DEFINE_uint32(idle_threads, 1000, "The number of idle tracked threads with small stacks to create.");
+
+inline static std::mutex output_mutex;
+inline void ThreadSafeLog(std::string const& s) {
+  std::lock_guard lock(output_mutex);
+  std::cout << s << std::endl;
+}
+
+struct HotInstance final {
+  HotInstance() { ThreadSafeLog("hot instance constructed"); }
+  ~HotInstance() { ThreadSafeLog("hot instance destructed"); }
+};
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  LIFETIME_MANAGER_SET_LOGGER([](std::string const& s) { std::cerr << "MGR: " << s << std::endl; });
+
+  LIFETIME_PLACEMENT_PROFILE_SET("hot", LifetimePlacement().CPUs({0}).Name("hot"));
+  LIFETIME_PLACEMENT_PROFILE_SET("bulk", LifetimePlacement().Nice(10).Name("bulk"));
+  LIFETIME_PLACEMENT_PROFILE_SET("idle", LifetimePlacement().StackSize(64 << 10).Name("idle"));
+
+  LIFETIME_TRACKED_INSTANCE_PLACED(HotInstance, LIFETIME_PLACEMENT_PROFILE("hot"), "hot instance");
+
+  LIFETIME_TRACKED_THREAD_PLACED("hot thread", LIFETIME_PLACEMENT_PROFILE("hot"), []() {
+    // The thread name and the CPU set, as seen by the OS.
+    std::string comm;
+    std::ifstream("/proc/thread-self/comm") >> comm;
+    ThreadSafeLog("hot thread: named `" + comm + "`, running on CPU " + current::ToString(::sched_getcpu()));
+  });
+
+  for (uint32_t i = 0u; i < FLAGS_idle_threads; ++i) {
+    LIFETIME_TRACKED_THREAD_PLACED("idle thread #" + current::ToString(i + 1u),
+                                   LIFETIME_PLACEMENT_PROFILE("idle"),
+                                   []() { LIFETIME_SLEEP_UNTIL_SHUTDOWN(); });
+  }
+  ThreadSafeLog(current::ToString(FLAGS_idle_threads) + " idle threads with 64KB stacks created");
+
+  // The children inherit the placement of the thread that spawns them.
+  for (auto const& profile : {"hot", "bulk"}) {
+    LIFETIME_TRACKED_POPEN2_PLACED(std::string("placed child ") + profile,
+                                   LIFETIME_PLACEMENT_PROFILE(profile),
+                                   {"bash", "-c", "grep Cpus_allowed_list /proc/self/status; echo nice $(nice)"},
+                                   [profile](std::string const& line) { ThreadSafeLog(profile + (": " + line)); });
+  }
+
+  LIFETIME_MANAGER_EXIT(0);
+}
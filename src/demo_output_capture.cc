@@ -0,0 +1,61 @@
+#include <iostream>
+#include <chrono>
+
+#include "popen2.h"
+#include "lib_c5t_lifetime_manager.h"
+#include "lib_c5t_output_capture.h"
+#include "bricks/dflags/dflags.h"
+
+DEFINE_string(capture_dir, ".current_capture", "The directory to capture the output of the child process into.");
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  LIFETIME_MANAGER_SET_LOGGER([](std::string const& s) { std::cerr << "MGR: " << s << std::endl; });
+
+  // Deliberately tiny segments and a dense index, to see the rotation and seeking by time in action.
+  OutputCaptureConfig capture;
+  capture.directory = FLAGS_capture_dir;
+  capture.segment_size = 16u << 10;
+  capture.max_segments = 4u;
+  capture.index_every_bytes = 256u;
+
+  auto const cmd = "for i in $(seq 6000); do echo \"line $i\"; [ $i = 5500 ] && sleep 0.5; done; true";
+  std::chrono::microseconds t_middle;
+  LIFETIME_TRACKED_POPEN2_CAPTURED(cmd, capture, {"bash", "-c", cmd}, [&t_middle](std::string const& line) {
+    if (line == "line 5500") {
+      t_middle = current::time::Now();
+    }
+  });
+
+  OutputCaptureReader reader(FLAGS_capture_dir);
+
+  auto const tail = reader.Tail(32u);
+  std::cout << "Tail:" << std::endl;
+  tail.ForEachLine([](std::string_view line) { std::cout << "  " << line << std::endl; });
+
+  size_t lines_since_middle = 0u;
+  std::string first_line_since_middle;
+  reader.Since(t_middle + std::chrono::milliseconds(250)).ForEachLine([&](std::string_view line) {
+    if (!lines_since_middle++) {
+      first_line_since_middle = line;
+    }
+  });
+  std::cout << "Since the pause: " << lines_since_middle << " lines, from `" << first_line_since_middle << "`."
+            << std::endl;
+
+  // When the file descriptor is at hand, the raw bytes go into the segments straight from the `read()` buffer.
+  {
+    OutputCaptureConfig raw_capture = capture;
+    raw_capture.directory = FLAGS_capture_dir + "_raw";
+    FILE* f = ::popen("seq 1000", "r");
+    if (f) {
+      OutputCaptureWriter(raw_capture).AppendFromFD(fileno(f));
+      ::pclose(f);
+    }
+    auto const raw_tail = OutputCaptureReader(raw_capture.directory).Tail(10u);
+    std::cout << "Raw capture tail:" << std::endl;
+    raw_tail.ForEachLine([](std::string_view line) { std::cout << "  " << line << std::endl; });
+  }
+
+  LIFETIME_MANAGER_EXIT(0);
+}
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <chrono>
+
+#include "popen2.h"
+#include "lib_c5t_lifetime_manager.h"
+#include "lib_c5t_popen2_cache.h"
+#include "bricks/dflags/dflags.h"
+
+DEFINE_string(cache_dir, ".current_popen2_cache", "The directory for the on-disk part of the cache.");
+
+inline static std::mutex output_mutex;
+inline void ThreadSafeLog(std::string const& s) {
+  std::lock_guard lock(output_mutex);
+  std::cout << s << std::endl;
+}
+
+inline void DumpStats(LifetimePopen2Cache const& cache) {
+  Popen2CacheStats const stats = cache.Stats();
+  ThreadSafeLog("memory hits " + current::ToString(stats.memory_hits) + ", disk hits " +
+                current::ToString(stats.disk_hits) + ", deduplicated " + current::ToString(stats.deduplicated) +
+                ", misses " + current::ToString(stats.misses));
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  LIFETIME_MANAGER_SET_LOGGER([](std::string const& s) { std::cerr << "MGR: " << s << std::endl; });
+
+  // A "deterministic" command that takes a while, so that the identical concurrent requests overlap.
+  std::vector<std::string> const cmd = {"bash", "-c", "sleep 0.25; echo started >&2; sort"};
+  std::string const input = "c\nb\na\n";
+
+  {
+    Popen2CacheConfig config;
+    config.directory = FLAGS_cache_dir;
+    LifetimePopen2Cache cache(config);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i) {
+      threads.emplace_back([&cache, &cmd, &input, i]() {
+        std::string output;
+        LIFETIME_CACHED_POPEN2(
+            cache, "sort", cmd, [&output](std::string const& line) { output += line + ' '; }, input);
+        ThreadSafeLog("concurrent #" + current::ToString(i) + ": " + output);
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    DumpStats(cache);
+
+    LIFETIME_CACHED_POPEN2(
+        cache, "sort", cmd, [](std::string const& line) { ThreadSafeLog("again: " + line); }, input);
+    DumpStats(cache);
+  }
+
+  {
+    // A fresh cache, as if in another run of the binary, which has the result on disk.
+    Popen2CacheConfig config;
+    config.directory = FLAGS_cache_dir;
+    LifetimePopen2Cache cache(config);
+    LIFETIME_CACHED_POPEN2(
+        cache, "sort", cmd, [](std::string const& line) { ThreadSafeLog("from disk: " + line); }, input);
+    DumpStats(cache);
+  }
+
+  LIFETIME_MANAGER_EXIT(0);
+}
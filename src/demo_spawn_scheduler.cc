@@ -0,0 +1,81 @@
+#include <iostream>
+#include <chrono>
+
+#include "popen2.h"
+#include "lib_c5t_lifetime_manager.h"
+#include "lib_c5t_spawn_scheduler.h"
+
+inline static std::mutex output_mutex;
+inline void ThreadSafeLog(std::string const& s) {
+  std::lock_guard lock(output_mutex);
+  std::cout << s << std::endl;
+}
+
+int main() {
+  LIFETIME_MANAGER_SET_LOGGER([](std::string const& s) { std::cerr << "MGR: " << s << std::endl; });
+
+  SpawnSchedulerConfig config;
+  config.max_concurrent = 2u;
+  config.max_concurrent_per_tag["slow"] = 1u;
+  auto& scheduler = LIFETIME_TRACKED_INSTANCE(LifetimeSpawnScheduler, "spawn scheduler", config);
+
+  auto const Spawn = [&scheduler](std::string const& name,
+                                  SpawnOptions options,
+                                  std::string const& cmd,
+                                  std::function<void(Popen2Runtime&)> cb_code = [](Popen2Runtime&) {}) {
+    LIFETIME_TRACKED_THREAD("caller of " + name, [&scheduler, name, options, cmd, cb_code]() {
+      SpawnResult const result = LIFETIME_SCHEDULED_POPEN2(
+          scheduler,
+          name,
+          options,
+          {"bash", "-c", cmd},
+          [name](std::string const& line) { ThreadSafeLog(name + ": " + line); },
+          cb_code);
+      ThreadSafeLog(name + " outcome " + current::ToString(static_cast<int>(result.outcome)) + ", exit code " +
+                    current::ToString(result.exit_code));
+    });
+  };
+
+  // The "slow" ones are capped to one at a time, so only one of these starts right away.
+  for (int i = 1; i <= 3; ++i) {
+    SpawnOptions options;
+    options.tag = "slow";
+    Spawn("slow #" + current::ToString(i), options, "echo started; sleep 0.5; echo done");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  // The deadline and the output cap can only kill the child while its `cb_code` runs, so keep it running for a bit.
+  auto const StayAround = [](std::chrono::milliseconds ms) {
+    return [ms](Popen2Runtime&) { LIFETIME_SLEEP_FOR(ms); };
+  };
+
+  // Killed by the deadline, which lets the next one in.
+  SpawnOptions deadline;
+  deadline.deadline = std::chrono::milliseconds(200);
+  Spawn("deadline", deadline, "echo started; for i in $(seq 100); do sleep 0.1; done; echo done", StayAround(std::chrono::milliseconds(250)));
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  // Queued, then killed by the output cap.
+  SpawnOptions capped;
+  capped.max_output_bytes = 50u;
+  Spawn("capped",
+        capped,
+        "for i in $(seq 1000); do echo $i; sleep 0.01; done",
+        StayAround(std::chrono::milliseconds(400)));
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  // Low priority, only starts when nothing of a higher priority is waiting.
+  // Unlike the last of the "slow" ones, which is still queued when the shutdown cancels it.
+  SpawnOptions low;
+  low.priority = SpawnPriority::Low;
+  Spawn("low priority", low, "echo started");
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ThreadSafeLog("");
+  ThreadSafeLog("Running and pending:");
+  LIFETIME_TRACKED_DEBUG_DUMP();
+  ThreadSafeLog("");
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(700));
+  LIFETIME_MANAGER_EXIT(0);
+}
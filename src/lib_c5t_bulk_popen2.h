@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bricks/strings/printf.h"
+#include "bricks/sync/waitable_atomic.h"
+
+#include "lib_c5t_lifetime_manager.h"
+
+// NOTE: The `xargs -P` of `LIFETIME_TRACKED_POPEN2`: the same command over many inputs, K children at once.
+//
+// Each argument of the command template has its "{}"-s replaced by the input. If no argument contains "{}",
+// the input is appended as the last argument. The stdin of each child is closed right away.
+//
+// The results, the exit code and the output lines per input, are passed to `cb_result` one at a time, never
+// concurrently, either in the order of completion or in the order of the inputs. For the latter the results that
+// complete early wait in the reorder buffer, and, to keep it bounded, no input is started more than `reorder_window`
+// inputs ahead of the oldest one still running.
+//
+// The whole batch is one tracked instance, with its progress in the description. Once termination is initiated,
+// the running children are killed as with `LIFETIME_TRACKED_POPEN2`, and the remaining inputs are not started.
+// The results of the killed children are still passed to `cb_result`, with `killed` set and the partial output,
+// and the returned stats tell how many inputs were killed and how many were never started.
+//
+// If `cb_result`, or `popen2()` itself, throws, no more inputs are started and no more results are passed on,
+// the running children are waited for, and the first exception is rethrown to the caller of `LIFETIME_BULK_POPEN2`.
+
+enum class BulkPopen2Order : int { Completion = 0, Input };
+
+struct BulkPopen2Config final {
+  size_t parallelism = std::max(1u, std::thread::hardware_concurrency());
+  BulkPopen2Order order = BulkPopen2Order::Completion;
+  size_t reorder_window = 0u;  // Only for `BulkPopen2Order::Input`, zero for `16 * parallelism`.
+};
+
+struct BulkPopen2Result final {
+  size_t index;
+  std::string input;
+  int exit_code;
+  std::vector<std::string> lines;
+  bool killed = false;  // The termination has sent the child its SIGTERM, the output may be partial.
+};
+
+struct BulkPopen2Stats final {
+  size_t total = 0u;
+  size_t started = 0u;
+  size_t completed = 0u;
+  size_t failed = 0u;       // Completed with a nonzero exit code and not killed, also counted in `completed`.
+  size_t killed = 0u;       // Killed at termination, also counted in `completed`.
+  size_t not_started = 0u;  // Never started because of the termination, only set once the batch is over.
+
+  std::string ToString() const {
+    std::string result = current::strings::Printf("%d/%d done, %d running, %d failed",
+                                                  static_cast<int>(completed),
+                                                  static_cast<int>(total),
+                                                  static_cast<int>(started - completed),
+                                                  static_cast<int>(failed));
+    if (killed || not_started) {
+      result += current::strings::Printf(
+          ", %d killed, %d not started", static_cast<int>(killed), static_cast<int>(not_started));
+    }
+    return result;
+  }
+};
+
+inline std::vector<std::string> BulkPopen2Cmdline(std::vector<std::string> const& cmd_template,
+                                                  std::string const& input) {
+  std::vector<std::string> result;
+  bool substituted = false;
+  for (std::string const& arg : cmd_template) {
+    std::string s;
+    size_t i = 0u;
+    while (true) {
+      size_t const j = arg.find("{}", i);
+      if (j == std::string::npos) {
+        s.append(arg, i, std::string::npos);
+        break;
+      }
+      s.append(arg, i, j - i);
+      s.append(input);
+      substituted = true;
+      i = j + 2u;
+    }
+    result.push_back(std::move(s));
+  }
+  if (!substituted) {
+    result.push_back(input);
+  }
+  return result;
+}
+
+template <class T_POPEN2_RUNTIME, class RANGE>
+BulkPopen2Stats LifetimeBulkPopen2(std::string const& text,
+                                   char const* file,
+                                   size_t line,
+                                   std::vector<std::string> const& cmd_template,
+                                   RANGE const& inputs,
+                                   std::function<void(BulkPopen2Result&&)> cb_result,
+                                   BulkPopen2Config const& config = BulkPopen2Config(),
+                                   std::vector<std::string> const& env = {}) {
+  using iterator_t = decltype(std::begin(inputs));
+
+  struct State final {
+    bool shutting_down = false;
+    iterator_t next_input;
+    iterator_t end_of_inputs;
+    size_t next_index = 0u;
+    size_t next_to_emit = 0u;  // For `BulkPopen2Order::Input`: everything before this index was passed to the user.
+    std::map<size_t, BulkPopen2Result> reorder_buffer;
+    BulkPopen2Stats stats;
+    std::exception_ptr exception;  // The first one thrown by any worker, stops starting new inputs.
+  };
+
+  size_t const parallelism = std::max(static_cast<size_t>(1u), config.parallelism);
+  size_t const reorder_window = config.reorder_window ? config.reorder_window : 16u * parallelism;
+  bool const in_input_order = (config.order == BulkPopen2Order::Input);
+
+  current::WaitableAtomic<State> state;
+  state.MutableUse([&](State& s) {
+    s.next_input = std::begin(inputs);
+    s.end_of_inputs = std::end(inputs);
+    s.stats.total = static_cast<size_t>(std::distance(std::begin(inputs), std::end(inputs)));
+  });
+
+  auto& mgr = LIFETIME_MANAGER_SINGLETON_IMPL();
+  auto const Description = [&text](BulkPopen2Stats const& stats) { return text + " [" + stats.ToString() + ']'; };
+  size_t const id =
+      mgr.TrackingAdd(Description(state.ImmutableUse([](State const& s) { return s.stats; })), file, line);
+
+  auto const termination_scope =
+      LIFETIME_NOTIFY_OF_SHUTDOWN([&state]() { state.MutableUse([](State& s) { s.shutting_down = true; }); });
+
+  // Held while passing the results to the user, so that `cb_result` is never called concurrently, and, for the input
+  // order, so that the results taken out of the reorder buffer reach the user in the order they were taken out.
+  std::mutex emit_mutex;
+
+  auto const SaveException = [&state](std::exception_ptr e) {
+    state.MutableUse([&e](State& s) {
+      if (!s.exception) {
+        s.exception = std::move(e);
+      }
+    });
+  };
+
+  auto const WorkerLoop = [&]() {
+    while (true) {
+      size_t index = 0u;
+      std::string input;
+      bool const has_next = [&]() {
+        bool result = false;
+        state.Wait([&](State const& s) {
+          return s.shutting_down || s.exception || s.next_input == s.end_of_inputs || !in_input_order ||
+                 s.next_index < s.next_to_emit + reorder_window;
+        });
+        state.MutableUse([&](State& s) {
+          if (!s.shutting_down && !s.exception && !LIFETIME_SHUTTING_DOWN && s.next_input != s.end_of_inputs) {
+            index = s.next_index++;
+            input = std::string(*s.next_input);
+            ++s.next_input;
+            ++s.stats.started;
+            result = true;
+          }
+        });
+        return result;
+      }();
+      if (!has_next) {
+        return;
+      }
+
+      BulkPopen2Result result{index, input, 0, {}, false};
+      std::atomic_bool killed(false);
+      result.exit_code = LifetimeTrackedPopen2Run<T_POPEN2_RUNTIME>(
+          BulkPopen2Cmdline(cmd_template, input),
+          [&result](std::string const& s) { result.lines.push_back(s); },
+          [](T_POPEN2_RUNTIME& ctx) { ctx.Close(); },
+          env,
+          &killed);
+      result.killed = killed;
+
+      std::lock_guard lock(emit_mutex);
+      std::vector<BulkPopen2Result> ready;
+      BulkPopen2Stats const stats = state.MutableUse([&](State& s) {
+        ++s.stats.completed;
+        if (result.killed) {
+          ++s.stats.killed;
+        } else if (result.exit_code) {
+          ++s.stats.failed;
+        }
+        if (in_input_order) {
+          s.reorder_buffer.emplace(index, std::move(result));
+          while (!s.reorder_buffer.empty() && s.reorder_buffer.begin()->first == s.next_to_emit) {
+            ready.push_back(std::move(s.reorder_buffer.begin()->second));
+            s.reorder_buffer.erase(s.reorder_buffer.begin());
+            ++s.next_to_emit;
+          }
+        } else {
+          ready.push_back(std::move(result));
+        }
+        return s.stats;
+      });
+      mgr.TrackingUpdate(id, Description(stats));
+      for (BulkPopen2Result& r : ready) {
+        if (state.ImmutableUse([](State const& s) { return static_cast<bool>(s.exception); })) {
+          return;
+        }
+        try {
+          cb_result(std::move(r));
+        } catch (...) {
+          // Recorded while still holding `emit_mutex`, so that no other result is passed on after this one.
+          SaveException(std::current_exception());
+          return;
+        }
+      }
+    }
+  };
+
+  auto const Worker = [&]() {
+    try {
+      WorkerLoop();
+    } catch (...) {
+      SaveException(std::current_exception());
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0u; i < parallelism; ++i) {
+    workers.emplace_back(Worker);
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  std::exception_ptr exception;
+  BulkPopen2Stats const stats = state.MutableUse([&exception](State& s) {
+    s.stats.not_started = s.stats.total - s.stats.started;
+    exception = s.exception;
+    return s.stats;
+  });
+  mgr.TrackingRemove(id);
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
+  return stats;
+}
+
+#define LIFETIME_BULK_POPEN2(text, ...) LifetimeBulkPopen2<Popen2Runtime>(text, __FILE__, __LINE__, __VA_ARGS__)
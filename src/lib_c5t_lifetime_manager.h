@@ -7,6 +7,21 @@
 #include <thread>
 #include <map>
 #include <set>
+#include <cstdlib>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "bricks/util/singleton.h"
 #include "bricks/strings/printf.h"
@@ -15,6 +30,149 @@
 #include "bricks/file/file.h"
 #include "bricks/time/chrono.h"
 
+// The time source of the lifetime manager: `Now()`, the `LIFETIME_SLEEP_FOR`-s, the `WaitFor` deadlines, and the
+// grace periods of `ExitForReal()` all go through it. By default it is the real clock.
+//
+// In the simulated mode the time only jumps forward when nothing is happening. Whoever waits registers a deadline,
+// and once there has been no activity for `quantum` of real time, the clock jumps to the earliest deadline.
+// So the two-second grace period takes a few milliseconds, while the order in which the waits end is that of their
+// deadlines. The spawned processes run in real time though. While the program runs they do not hold the clock back,
+// but once the termination is initiated, and until every `popen2()`-spawned child has exited, the simulated clock
+// does not jump, but ticks along with the real one, so that the grace period means what it would for real for
+// a child that takes its time to die.
+//
+// The simulated mode is enabled by the `C5T_LIFETIME_SIMULATED_CLOCK` environment variable, with the value being
+// the quantum in milliseconds, or by `LIFETIME_MANAGER_USE_SIMULATED_CLOCK()` before the lifetime manager is used.
+struct LifetimeManagerClock final {
+  struct SimulatedState final {
+    std::chrono::microseconds now;
+    std::multiset<std::chrono::microseconds> deadlines;
+    std::chrono::steady_clock::time_point last_activity;
+    std::chrono::steady_clock::time_point last_tick;
+    size_t children_dying = 0u;
+  };
+
+  std::atomic_bool simulated_;
+  std::chrono::microseconds quantum_;
+  current::WaitableAtomic<SimulatedState> state_;
+
+  LifetimeManagerClock()
+      : simulated_(false),
+        quantum_(std::chrono::milliseconds(1)),
+        state_(SimulatedState{
+            current::time::Now(), {}, std::chrono::steady_clock::now(), std::chrono::steady_clock::now(), 0u}) {
+    if (char const* env = std::getenv("C5T_LIFETIME_SIMULATED_CLOCK")) {
+      SetSimulated(std::chrono::milliseconds(std::max(1, std::atoi(env))));
+    }
+  }
+
+  void SetSimulated(std::chrono::microseconds quantum) {
+    quantum_ = quantum;
+    simulated_ = true;
+  }
+
+  std::chrono::microseconds Now() const {
+    if (!simulated_) {
+      return current::time::Now();
+    }
+    return state_.ImmutableUse([](SimulatedState const& s) { return s.now; });
+  }
+
+  // Anything that may affect the waiters, such as a tracked instance added or removed, delays the jump forward.
+  void NoteActivity() {
+    if (simulated_) {
+      state_.MutableUse([](SimulatedState& s) { s.last_activity = std::chrono::steady_clock::now(); });
+    }
+  }
+
+  // Called for each spawned child still alive once the termination is initiated, and once that child has exited.
+  void ChildDying() {
+    if (simulated_) {
+      state_.MutableUse([](SimulatedState& s) {
+        if (!s.children_dying++) {
+          // Nothing was ticking the clock along with the real one until now.
+          s.last_tick = std::chrono::steady_clock::now();
+        }
+      });
+    }
+  }
+  void DyingChildExited() {
+    if (simulated_) {
+      state_.MutableUse([](SimulatedState& s) {
+        if (s.children_dying) {
+          --s.children_dying;
+        }
+        s.last_activity = std::chrono::steady_clock::now();
+      });
+    }
+  }
+
+  // Waits until `pred` holds for the value of `wa`, or until `dt` passes. Returns whether `pred` holds.
+  template <class T, class F>
+  bool WaitFor(current::WaitableAtomic<T> const& wa, F&& pred, std::chrono::microseconds dt) {
+    if (!simulated_) {
+      return wa.WaitFor(pred, dt);
+    }
+    std::chrono::microseconds const deadline = state_.MutableUse([dt](SimulatedState& s) {
+      auto const t = std::chrono::steady_clock::now();
+      if (s.deadlines.empty()) {
+        // Nobody was waiting, so nobody was ticking the clock, and the real time that has passed does not count.
+        s.last_tick = t;
+      }
+      s.deadlines.insert(s.now + dt);
+      s.last_activity = t;
+      return s.now + dt;
+    });
+    bool result = false;
+    while (true) {
+      // NOTE: Polling, since the jump forward of the clock does not notify `wa`.
+      if (wa.WaitFor(pred, quantum_)) {
+        result = true;
+        break;
+      }
+      if (TryAdvanceAndCheck(deadline)) {
+        result = wa.ImmutableUse(pred);
+        break;
+      }
+    }
+    state_.MutableUse([deadline](SimulatedState& s) {
+      s.deadlines.erase(s.deadlines.find(deadline));
+      s.last_activity = std::chrono::steady_clock::now();
+    });
+    return result;
+  }
+
+  void SleepFor(std::chrono::microseconds dt) {
+    if (!simulated_) {
+      std::this_thread::sleep_for(dt);
+    } else {
+      current::WaitableAtomic<bool> never(false);
+      WaitFor(never, [](bool b) { return b; }, dt);
+    }
+  }
+
+  // Returns whether `deadline` has been reached, moving the clock forward first: along with the real clock if some
+  // children are dying, or else jumping to the earliest deadline if it is time to.
+  bool TryAdvanceAndCheck(std::chrono::microseconds deadline) {
+    return state_.MutableUse([this, deadline](SimulatedState& s) {
+      auto const t = std::chrono::steady_clock::now();
+      if (s.children_dying) {
+        s.now += std::chrono::duration_cast<std::chrono::microseconds>(t - s.last_tick);
+      } else if (s.now < deadline && !s.deadlines.empty() && *s.deadlines.begin() > s.now &&
+                 t - s.last_activity >= quantum_) {
+        s.now = *s.deadlines.begin();
+        s.last_activity = t;
+      }
+      s.last_tick = t;
+      return s.now >= deadline;
+    });
+  }
+};
+
+#define LIFETIME_MANAGER_CLOCK_IMPL() current::Singleton<LifetimeManagerClock>()
+
+inline std::chrono::microseconds LIFETIME_NOW() { return LIFETIME_MANAGER_CLOCK_IMPL().Now(); }
+
 struct LifetimeTrackedInstance final {
   std::string description;
   std::string file_fullname;
@@ -22,6 +180,7 @@ struct LifetimeTrackedInstance final {
   uint32_t line_as_number;
   std::string line_as_string;
   std::chrono::microseconds t_added;
+  bool pending = false;  // Registered, but waiting for its turn to start, i.e. queued in some scheduler.
 
   static std::string BaseName(std::string const& s) {
     char const* r = s.c_str();
@@ -37,15 +196,19 @@ struct LifetimeTrackedInstance final {
   LifetimeTrackedInstance(std::string desc,
                           std::string file,
                           uint32_t line,
-                          std::chrono::microseconds t = current::time::Now())
+                          std::chrono::microseconds t = LIFETIME_NOW(),
+                          bool is_pending = false)
       : description(std::move(desc)),
         file_fullname(std::move(file)),
         file_basename(BaseName(file_fullname)),
         line_as_number(line),
         line_as_string(current::ToString(line_as_number)),
-        t_added(t) {}
+        t_added(t),
+        pending(is_pending) {}
 
-  std::string ToShortString() const { return description + " @ " + file_basename + ':' + line_as_string; }
+  std::string ToShortString() const {
+    return (pending ? "[pending] " : "") + description + " @ " + file_basename + ':' + line_as_string;
+  }
 };
 
 struct LifetimeManagerSingleton final {
@@ -65,9 +228,14 @@ struct LifetimeManagerSingleton final {
   current::WaitableAtomic<std::atomic_bool> termination_initiated_;
   std::atomic_bool& termination_initiated_atomic_;
 
+  // The thread that runs the termination sequence, and whether the destructor is waiting for it on another thread.
+  std::atomic<std::thread::id> terminating_thread_;
+  std::atomic_bool destructor_waiting_;
+
   current::WaitableAtomic<TrackedInstances> tracking_;
 
   std::vector<std::thread> threads_to_join_;
+  std::vector<pthread_t> pthreads_to_join_;  // The threads with a custom stack size, which `std::thread` can not do.
   std::mutex threads_to_join_mutex_;
 
   void Log(std::string const& s) const {
@@ -82,7 +250,11 @@ struct LifetimeManagerSingleton final {
   LifetimeManagerSingleton()
       : logger_initialized_(false),
         termination_initiated_(false),
-        termination_initiated_atomic_(*termination_initiated_.MutableScopedAccessor()) {}
+        termination_initiated_atomic_(*termination_initiated_.MutableScopedAccessor()),
+        destructor_waiting_(false) {
+    // Construct the clock first, so that it is destructed after this singleton, which uses it in its destructor.
+    static_cast<void>(LIFETIME_MANAGER_CLOCK_IMPL());
+  }
 
   void SetLogger(std::function<void(std::string const&)> logger) const {
     logger_initialized_ = true;
@@ -98,18 +270,41 @@ struct LifetimeManagerSingleton final {
     }
   }
 
-  size_t TrackingAdd(std::string const& description, char const* file, size_t line) {
+  size_t TrackingAdd(std::string const& description, char const* file, size_t line, bool pending = false) {
     EnsureHasLogger();
-    return tracking_.MutableUse([=](TrackedInstances& trk) {
+    size_t const id = tracking_.MutableUse([=](TrackedInstances& trk) {
       uint64_t const id = trk.next_id_desc;
       --trk.next_id_desc;
-      trk.still_alive[id] = LifetimeTrackedInstance(description, file, line);
+      trk.still_alive[id] = LifetimeTrackedInstance(description, file, line, LIFETIME_NOW(), pending);
       return id;
     });
+    LIFETIME_MANAGER_CLOCK_IMPL().NoteActivity();
+    return id;
+  }
+
+  // For the instances added as `pending`, once they actually start.
+  void TrackingMarkStarted(size_t id) {
+    tracking_.MutableUse([=](TrackedInstances& trk) {
+      auto it = trk.still_alive.find(id);
+      if (it != std::end(trk.still_alive)) {
+        it->second.pending = false;
+      }
+    });
+  }
+
+  // For the long-running tracked instances to report their progress in `LIFETIME_TRACKED_DEBUG_DUMP`.
+  void TrackingUpdate(size_t id, std::string description) {
+    tracking_.MutableUse([&](TrackedInstances& trk) {
+      auto it = trk.still_alive.find(id);
+      if (it != std::end(trk.still_alive)) {
+        it->second.description = std::move(description);
+      }
+    });
   }
 
   void TrackingRemove(size_t id) {
     tracking_.MutableUse([=](TrackedInstances& trk) { trk.still_alive.erase(id); });
+    LIFETIME_MANAGER_CLOCK_IMPL().NoteActivity();
   }
 
   // To run "global" threads instead of `.detach()`-ing them: these threads will be `.join()`-ed upon termination.
@@ -127,6 +322,44 @@ struct LifetimeManagerSingleton final {
     });
   }
 
+  // Same as `EmplaceThreadImpl`, but the thread gets a stack of the provided size, unless it is zero.
+  void EmplaceThreadWithStackSizeImpl(size_t stack_size, std::function<void()> body) {
+    if (!stack_size) {
+      EmplaceThreadImpl(std::move(body));
+      return;
+    }
+    EnsureHasLogger();
+    termination_initiated_.ImmutableUse([&](bool already_terminating) {
+      if (!already_terminating) {
+        pthread_attr_t attr;
+        ::pthread_attr_init(&attr);
+        size_t const effective_stack_size = std::max(stack_size, static_cast<size_t>(PTHREAD_STACK_MIN));
+        if (::pthread_attr_setstacksize(&attr, effective_stack_size)) {
+          Log(current::strings::Printf("The stack size of %zu bytes is rejected, using the default stack.",
+                                       effective_stack_size));
+        }
+        auto* heap_body = new std::function<void()>(std::move(body));
+        pthread_t thread;
+        std::lock_guard lock(threads_to_join_mutex_);
+        if (!::pthread_create(&thread, &attr, PthreadTrampoline, heap_body)) {
+          pthreads_to_join_.push_back(thread);
+        } else {
+          Log(current::strings::Printf("Can not create a thread with a %zu bytes stack, using the default stack.",
+                                       stack_size));
+          threads_to_join_.emplace_back(std::move(*heap_body));
+          delete heap_body;
+        }
+        ::pthread_attr_destroy(&attr);
+      }
+    });
+  }
+
+  static void* PthreadTrampoline(void* heap_body) {
+    std::unique_ptr<std::function<void()>> const body(static_cast<std::function<void()>*>(heap_body));
+    (*body)();
+    return nullptr;
+  }
+
   [[nodiscard]] current::WaitableAtomicSubscriberScope SubscribeToTerminationEvent(std::function<void()> f0) {
     EnsureHasLogger();
     // Ensures that `f0()` will only be called once, possibly from the very call to `SubscribeToTerminationEvent()`.
@@ -179,17 +412,19 @@ struct LifetimeManagerSingleton final {
   }
 
   void DoExitForReal(int exit_code = 0, std::chrono::milliseconds graceful_delay = std::chrono::seconds(2)) {
-    auto const t0 = current::time::Now();
+    auto& clock = LIFETIME_MANAGER_CLOCK_IMPL();
+    auto const t0 = clock.Now();
     std::map<uint64_t, LifetimeTrackedInstance> original_still_alive = tracking_.ImmutableScopedAccessor()->still_alive;
     std::vector<uint64_t> still_alive_ids;
     for (auto const& e : original_still_alive) {
       still_alive_ids.push_back(e.first);
     }
     bool ok = false;
-    tracking_.WaitFor(
-        [this, &ok, &original_still_alive, &still_alive_ids, t0](TrackedInstances const& trk) {
+    clock.WaitFor(
+        tracking_,
+        [this, &clock, &ok, &original_still_alive, &still_alive_ids, t0](TrackedInstances const& trk) {
           std::vector<uint64_t> next_still_alive_ids;
-          auto const t1 = current::time::Now();
+          auto const t1 = clock.Now();
           for (uint64_t id : still_alive_ids) {
             auto const cit = trk.still_alive.find(id);
             if (cit == std::end(trk.still_alive)) {
@@ -216,19 +451,26 @@ struct LifetimeManagerSingleton final {
         graceful_delay);
     if (ok) {
       Log("`ExitForReal()` termination sequence successful, joining the presumably-done threads.");
-      std::vector<std::thread> threads_to_join = [this]() {
+      std::vector<std::thread> threads_to_join;
+      std::vector<pthread_t> pthreads_to_join;
+      {
         std::lock_guard lock(threads_to_join_mutex_);
-        return std::move(threads_to_join_);
-      }();
+        threads_to_join = std::move(threads_to_join_);
+        pthreads_to_join = std::move(pthreads_to_join_);
+      }
       current::WaitableAtomic<bool> threads_joined_successfully(false);
-      std::thread threads_joiner([&threads_to_join, &threads_joined_successfully]() {
+      std::thread threads_joiner([&threads_to_join, &pthreads_to_join, &threads_joined_successfully]() {
         for (auto& t : threads_to_join) {
           t.join();
         }
+        for (pthread_t t : pthreads_to_join) {
+          ::pthread_join(t, nullptr);
+        }
         threads_joined_successfully.SetValue(true);
       });
       bool need_to_abort_because_threads_are_not_all_joined = true;
-      threads_joined_successfully.WaitFor(
+      clock.WaitFor(
+          threads_joined_successfully,
           [&need_to_abort_because_threads_are_not_all_joined](bool b) {
             if (b) {
               need_to_abort_because_threads_are_not_all_joined = false;
@@ -242,6 +484,11 @@ struct LifetimeManagerSingleton final {
         Log("`ExitForReal()` termination sequence successful, all threads joined.");
         threads_joiner.join();
         Log("`ExitForReal()` termination sequence successful, all done.");
+        if (destructor_waiting_) {
+          // The static destructors are being run by the `::exit()` that follows the return from `main()`.
+          std::fflush(nullptr);
+          ::_exit(exit_code);
+        }
         ::exit(exit_code);
       } else {
         Log("");
@@ -262,33 +509,66 @@ struct LifetimeManagerSingleton final {
     }
   }
 
-  void ExitForReal(int exit_code = 0, std::chrono::milliseconds graceful_delay = std::chrono::seconds(2)) {
-    bool const previous_value = termination_initiated_.MutableUse([](std::atomic_bool& already_terminating) {
+  // Marks the termination as initiated, returns whether it already was. The thread that initiates it runs the
+  // termination sequence, which ends with `::exit()` or `::abort()`.
+  bool InitiateTermination() {
+    return termination_initiated_.MutableUse([this](std::atomic_bool& already_terminating) {
       bool const retval = already_terminating.load();
-      already_terminating = true;
+      if (!retval) {
+        terminating_thread_ = std::this_thread::get_id();
+        already_terminating = true;
+      }
       return retval;
     });
+  }
+
+  // Whether the calling thread is the one that runs `main()`, and would return from it.
+  static bool IsMainThread() {
+#if defined(__linux__)
+    return static_cast<pid_t>(::syscall(SYS_gettid)) == ::getpid();
+#elif defined(__APPLE__)
+    return ::pthread_main_np() != 0;
+#else
+    return true;
+#endif
+  }
 
-    if (previous_value) {
-      Log("Ignoring a consecutive call to `ExitForReal()`.");
+  void ExitForReal(int exit_code = 0, std::chrono::milliseconds graceful_delay = std::chrono::seconds(2)) {
+    if (InitiateTermination()) {
+      if (IsMainThread()) {
+        // The termination sequence is already running in some other thread, i.e. the signal listener one, and it
+        // will `::exit()` or `::abort()`. Returning from here would let `main()` return and destruct stuff
+        // concurrently, so `main()` waits for the termination sequence to end the program.
+        Log("`ExitForReal()` already in progress, waiting for it to complete.");
+        SleepUntilExit();
+      }
+      // Any other thread should just return and wrap up, as it may well be tracked, and waited for.
+      Log("`ExitForReal()` already in progress, ignored.");
     } else {
       Log("`ExitForReal()` called, initating termination sequence.");
       DoExitForReal(exit_code, graceful_delay);
     }
   }
 
+  [[noreturn]] void SleepUntilExit() {
+    WaitUntilTimeToDie();
+    while (true) {
+      std::this_thread::sleep_for(std::chrono::hours(1));
+    }
+  }
+
   ~LifetimeManagerSingleton() {
     // Should die organically!
-    bool const previous_value = termination_initiated_.MutableUse([](std::atomic_bool& already_terminating) {
-      bool const retval = already_terminating.load();
-      already_terminating = true;
-      return retval;
-    });
-
-    if (!previous_value) {
+    if (!InitiateTermination()) {
       Log("");
       Log("The program is terminating organically.");
       DoExitForReal();
+    } else if (terminating_thread_.load() != std::this_thread::get_id()) {
+      // `main()` has returned while the termination sequence runs elsewhere, i.e. started by a signal.
+      // Destructing stuff now would race with it, so wait for it to end the program.
+      Log("The program is terminating organically, while the termination sequence is in progress, waiting for it.");
+      destructor_waiting_ = true;
+      SleepUntilExit();
     }
   }
 };
@@ -311,17 +591,174 @@ inline void LIFETIME_SLEEP_UNTIL_SHUTDOWN() { LIFETIME_MANAGER_SINGLETON_IMPL().
 // Use in place of `std::this_thread::sleep_for(...)`. Also returns `false` if it's time to die.
 template <class DT>
 inline bool LIFETIME_SLEEP_FOR(DT&& dt) {
-  LIFETIME_MANAGER_SINGLETON_IMPL().termination_initiated_.WaitFor([](std::atomic_bool const& b) { return b.load(); },
-                                                                   std::forward<DT>(dt));
+  LIFETIME_MANAGER_CLOCK_IMPL().WaitFor(LIFETIME_MANAGER_SINGLETON_IMPL().termination_initiated_,
+                                        [](std::atomic_bool const& b) { return b.load(); },
+                                        std::chrono::duration_cast<std::chrono::microseconds>(std::forward<DT>(dt)));
   return !LIFETIME_SHUTTING_DOWN;
 }
 
+// Same as `std::this_thread::sleep_for(...)`, but respects the simulated clock. Does not wake up on termination.
+template <class DT>
+inline void LIFETIME_UNINTERRUPTIBLE_SLEEP_FOR(DT&& dt) {
+  LIFETIME_MANAGER_CLOCK_IMPL().SleepFor(std::chrono::duration_cast<std::chrono::microseconds>(std::forward<DT>(dt)));
+}
+
+// Use in place of `waitable_atomic.WaitFor(predicate, dt)`, to respect the simulated clock.
+template <class T, class F, class DT>
+inline bool LIFETIME_WAIT_FOR(current::WaitableAtomic<T> const& wa, F&& pred, DT&& dt) {
+  return LIFETIME_MANAGER_CLOCK_IMPL().WaitFor(
+      wa, std::forward<F>(pred), std::chrono::duration_cast<std::chrono::microseconds>(std::forward<DT>(dt)));
+}
+
+inline void LIFETIME_MANAGER_USE_SIMULATED_CLOCK(std::chrono::microseconds quantum = std::chrono::milliseconds(1)) {
+  LIFETIME_MANAGER_CLOCK_IMPL().SetSimulated(quantum);
+}
+
 #define LIFETIME_TRACKED_DEBUG_DUMP(...) LIFETIME_MANAGER_SINGLETON_IMPL().DumpActive(__VA_ARGS__)
 
+// Called from `main()` once the termination is already initiated elsewhere, i.e. by a signal, it never returns, same as
+// `LIFETIME_MANAGER_SLEEP_UNTIL_EXIT()`. Called from any other thread at that point it is ignored, and returns.
 inline void LIFETIME_MANAGER_EXIT(int code = 0, std::chrono::milliseconds graceful_delay = std::chrono::seconds(2)) {
   LIFETIME_MANAGER_SINGLETON_IMPL().ExitForReal(code, graceful_delay);
 }
 
+// For `main()` once the termination may be initiated elsewhere, i.e. by a signal. Never returns: whichever thread
+// runs the termination sequence will `::exit()` or `::abort()`, and `main()` must not return and destruct stuff first.
+[[noreturn]] inline void LIFETIME_MANAGER_SLEEP_UNTIL_EXIT() { LIFETIME_MANAGER_SINGLETON_IMPL().SleepUntilExit(); }
+
+// NOTE: The OS signals, SIGTERM and friends, start the same termination sequence as `LIFETIME_MANAGER_EXIT`.
+//
+// It is the self-pipe trick: the signal handler only `write()`-s the signal number into a pipe, which is
+// async-signal-safe, and the dedicated listener thread, blocked on `read()`-ing this pipe, wakes up right away
+// and calls `ExitForReal()` with the exit code and the graceful delay configured for this signal.
+//
+// Not `signalfd()`: it is Linux-only, and it needs the signals blocked, while the blocked signal mask would be
+// inherited by the `popen2()`-spawned children, which then could not be stopped with a SIGTERM.
+// With the handler the children are fine, as `exec()` resets the caught signals to their default actions.
+// Between `fork()` and `exec()` the child still has the handler and the pipe though, so the handler checks the pid,
+// and in a not-yet-`exec()`-ed child it restores the default action and re-raises, instead of stopping the parent.
+//
+// The listener thread is not tracked, as it is the one to run the termination sequence and to `::exit()`.
+// The listener is deliberately never destructed, so that neither the handler nor the thread ever see it gone.
+// Once the termination is initiated, the repeated signals are ignored, so use SIGKILL to really kill it.
+
+struct LifetimeSignalAction final {
+  int exit_code;
+  std::chrono::milliseconds graceful_delay;
+};
+
+struct LifetimeSignalsConfig final {
+  std::map<int, LifetimeSignalAction> actions;
+
+  LifetimeSignalsConfig& On(int signo,
+                            int exit_code,
+                            std::chrono::milliseconds graceful_delay = std::chrono::seconds(2)) {
+    actions[signo] = LifetimeSignalAction{exit_code, graceful_delay};
+    return *this;
+  }
+
+  // SIGTERM, SIGINT, and SIGHUP, with the conventional exit code of `128 + signal number`.
+  static LifetimeSignalsConfig Default(std::chrono::milliseconds graceful_delay = std::chrono::seconds(2)) {
+    LifetimeSignalsConfig config;
+    for (int signo : {SIGTERM, SIGINT, SIGHUP}) {
+      config.On(signo, 128 + signo, graceful_delay);
+    }
+    return config;
+  }
+};
+
+class LifetimeSignalListener final {
+ public:
+  static LifetimeSignalListener& Instance() {
+    static LifetimeSignalListener* const instance = new LifetimeSignalListener();
+    return *instance;
+  }
+
+  void Handle(LifetimeSignalsConfig const& config) {
+    auto& mgr = LIFETIME_MANAGER_SINGLETON_IMPL();
+    mgr.EnsureHasLogger();
+    std::lock_guard lock(mutex_);
+    if (write_fd_ < 0) {
+      int fds[2];
+      if (::pipe(fds)) {
+        mgr.Log("Can not create the pipe to listen to signals, not handling them.");
+        return;
+      }
+      for (int fd : fds) {
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+      // Non-blocking, so that the handler never hangs. Once the pipe is full, the termination has long started.
+      ::fcntl(fds[1], F_SETFL, ::fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+      owner_pid_ = ::getpid();
+      write_fd_ = fds[1];
+      std::thread([this, read_fd = fds[0]]() { Listen(read_fd); }).detach();
+    }
+    for (auto const& [signo, action] : config.actions) {
+      actions_[signo] = action;
+      struct sigaction sa;
+      std::memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = SignalHandler;
+      ::sigemptyset(&sa.sa_mask);
+      sa.sa_flags = SA_RESTART;
+      if (::sigaction(signo, &sa, nullptr)) {
+        mgr.Log(current::strings::Printf("Can not handle signal %d.", signo));
+      }
+    }
+  }
+
+ private:
+  static inline std::atomic_int write_fd_{-1};
+  static inline std::atomic<pid_t> owner_pid_{0};
+  std::mutex mutex_;
+  std::map<int, LifetimeSignalAction> actions_;
+
+  LifetimeSignalListener() = default;
+
+  static void SignalHandler(int signo) {
+    // Only the async-signal-safe calls here, and `errno` is preserved for the code this handler has interrupted.
+    int const saved_errno = errno;
+    if (::getpid() != owner_pid_.load()) {
+      // A freshly `fork()`-ed child, say, being killed by a scheduler deadline before it had a chance to `exec()`.
+      ::signal(signo, SIG_DFL);
+      ::raise(signo);
+      errno = saved_errno;
+      return;
+    }
+    unsigned char const byte = static_cast<unsigned char>(signo);
+    ssize_t const unused = ::write(write_fd_.load(), &byte, 1u);
+    static_cast<void>(unused);
+    errno = saved_errno;
+  }
+
+  void Listen(int read_fd) {
+    auto& mgr = LIFETIME_MANAGER_SINGLETON_IMPL();
+    while (true) {
+      unsigned char byte;
+      ssize_t const n = ::read(read_fd, &byte, 1u);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n != 1) {
+        mgr.Log("The signals pipe is broken, no longer handling signals.");
+        return;
+      }
+      int const signo = static_cast<int>(byte);
+      LifetimeSignalAction const action = [&]() {
+        std::lock_guard lock(mutex_);
+        return actions_.at(signo);
+      }();
+      mgr.Log(current::strings::Printf("Got signal %d.", signo));
+      // Returns right away if the termination is already underway, otherwise never returns.
+      mgr.ExitForReal(action.exit_code, action.graceful_delay);
+    }
+  }
+};
+
+// Call once from `main()`, possibly with `LifetimeSignalsConfig().On(SIGTERM, 0).On(SIGINT, 1, 100ms)`, etc.
+inline void LIFETIME_MANAGER_HANDLE_SIGNALS(LifetimeSignalsConfig const& config = LifetimeSignalsConfig::Default()) {
+  LifetimeSignalListener::Instance().Handle(config);
+}
+
 // This is a bit of a "singleton instance" creator.
 // Not recommended to use overall, as it would create one thread per instance,
 // as opposed to "a single thread to own them all". But okay for the test and for quick experiments.
@@ -381,26 +818,55 @@ void LIFETIME_TRACKED_THREAD(std::string desc, F&& body, ARGS&&... args) {
 // NOTE(dkorolev): This `T_POPEN2_RUNTIME` is not a useful template type per se, it is only here to ensure
 //                 that the function is not compiled until used. This way, if `C5T/popen` is neither included
 //                 nor used, there are no build warnings/errors whatsoever.
+// The `popen2()` part of `LIFETIME_TRACKED_POPEN2`, for the callers that keep track of the lifetime themselves.
+// If `killed` is set, it is set to `true` once the termination has sent the child its SIGTERM.
 template <class T_POPEN2_RUNTIME>
-inline int LIFETIME_TRACKED_POPEN2_IMPL(
-    std::string const& text,
-    char const* file,
-    size_t line,
-    std::vector<std::string> const& cmdline,
-    std::function<void(const std::string&)> cb_line,
-    std::function<void(T_POPEN2_RUNTIME&)> cb_code = [](T_POPEN2_RUNTIME&) {},
-    std::vector<std::string> const& env = {}) {
+inline int LifetimeTrackedPopen2Run(std::vector<std::string> const& cmdline,
+                                    std::function<void(const std::string&)> cb_line,
+                                    std::function<void(T_POPEN2_RUNTIME&)> cb_code,
+                                    std::vector<std::string> const& env,
+                                    std::atomic_bool* killed = nullptr) {
   auto& mgr = LIFETIME_MANAGER_SINGLETON_IMPL();
-  size_t const id = mgr.TrackingAdd(text, file, line);
+  auto& clock = LIFETIME_MANAGER_CLOCK_IMPL();
+  // Once the termination is initiated, the simulated clock does not jump until this child exits, be it killed, or,
+  // if its `cb_code` has returned already, left to finish on its own. Whether it has exited and whether it is holding
+  // the clock are under one mutex, so that the clock is held at most once, and released once the child has exited.
+  struct DyingState final {
+    std::mutex mutex;
+    bool exited = false;
+    bool holding_clock = false;
+  };
+  std::shared_ptr<DyingState> dying = std::make_shared<DyingState>();
+  auto const dying_scope = mgr.SubscribeToTerminationEvent([&clock, dying]() {
+    std::lock_guard lock(dying->mutex);
+    if (!dying->exited && !dying->holding_clock) {
+      dying->holding_clock = true;
+      clock.ChildDying();
+    }
+  });
+  struct ExitedScope final {
+    LifetimeManagerClock& clock;
+    DyingState& state;
+    ~ExitedScope() {
+      std::lock_guard lock(state.mutex);
+      state.exited = true;
+      if (state.holding_clock) {
+        clock.DyingChildExited();
+      }
+    }
+  } const exited_scope{clock, *dying};
   std::shared_ptr<std::atomic_bool> popen2_done = std::make_shared<std::atomic_bool>(false);
   int const retval = popen2(
       cmdline,
       cb_line,
-      [copy_popen_done = popen2_done, &mgr, moved_cb_code = std::move(cb_code)](T_POPEN2_RUNTIME& ctx) {
+      [copy_popen_done = popen2_done, &mgr, killed, moved_cb_code = std::move(cb_code)](T_POPEN2_RUNTIME& ctx) {
         // NOTE(dkorolev): On `popen2()` level it's OK to call `.Kill()` multiple times, only one will go through.
         auto const scope =
-            mgr.SubscribeToTerminationEvent([&ctx, &mgr, captured_popen_done = std::move(copy_popen_done)]() {
+            mgr.SubscribeToTerminationEvent([&ctx, &mgr, killed, captured_popen_done = std::move(copy_popen_done)]() {
               if (!captured_popen_done->load()) {
+                if (killed) {
+                  *killed = true;
+                }
                 ctx.Kill();
               }
             });
@@ -408,10 +874,28 @@ inline int LIFETIME_TRACKED_POPEN2_IMPL(
       },
       env);
   popen2_done->store(true);
-  mgr.TrackingRemove(id);
   return retval;
 }
 
+template <class T_POPEN2_RUNTIME>
+inline int LIFETIME_TRACKED_POPEN2_IMPL(
+    std::string const& text,
+    char const* file,
+    size_t line,
+    std::vector<std::string> const& cmdline,
+    std::function<void(const std::string&)> cb_line,
+    std::function<void(T_POPEN2_RUNTIME&)> cb_code = [](T_POPEN2_RUNTIME&) {},
+    std::vector<std::string> const& env = {}) {
+  auto& mgr = LIFETIME_MANAGER_SINGLETON_IMPL();
+  // Removed on the way out even if a callback throws, as a leftover tracked instance means an `::abort()` at exit.
+  struct TrackedScope final {
+    LifetimeManagerSingleton& mgr;
+    size_t const id;
+    ~TrackedScope() { mgr.TrackingRemove(id); }
+  } const scope{mgr, mgr.TrackingAdd(text, file, line)};
+  return LifetimeTrackedPopen2Run<T_POPEN2_RUNTIME>(cmdline, std::move(cb_line), std::move(cb_code), env);
+}
+
 #define LIFETIME_TRACKED_POPEN2(text, ...) \
   LIFETIME_TRACKED_POPEN2_IMPL<Popen2Runtime>(text, __FILE__, __LINE__, __VA_ARGS__)
 
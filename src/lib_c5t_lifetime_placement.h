@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "bricks/strings/printf.h"
+#include "bricks/util/singleton.h"
+
+#include "lib_c5t_lifetime_manager.h"
+
+// NOTE: Where and how the tracked threads and the `popen2()`-spawned children run.
+//
+// The CPU set, the NUMA node, the nice value and the scheduling policy are applied to the thread itself, from within.
+// The children inherit all of them, including the preferred NUMA node for memory, as `LIFETIME_TRACKED_POPEN2_PLACED`
+// runs `popen2()` from a helper thread that has the placement applied.
+//
+// The stack size only applies to the threads; a small one is what makes thousands of idle tracked threads cheap.
+// The name is what `top -H`, `gdb`, and `/proc/<pid>/task/<tid>/comm` show, truncated to 15 characters.
+//
+// Failing to apply a part of the placement, i.e. a real-time policy without the permissions, is logged and ignored.
+// The CPU sets, the NUMA nodes, and the per-thread nice values are Linux-only, elsewhere they are logged and ignored.
+//
+// The named profiles are for the placements used in several places: `LIFETIME_PLACEMENT_PROFILE_SET("hot", ...)`
+// once, and then `LIFETIME_PLACEMENT_PROFILE("hot")` wherever the placement is needed.
+
+struct LifetimePlacementException final : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+struct LifetimePlacement final {
+  std::vector<int> cpus;   // Empty to keep the inherited CPU set.
+  int numa_node = -1;      // The CPUs of this node, intersected with `cpus` if set, and its memory preferred.
+  bool has_nice = false;   // The nice value is only changed if set explicitly.
+  int nice = 0;
+  int sched_policy = -1;   // I.e. `SCHED_FIFO`, -1 to keep the inherited one.
+  int sched_priority = 0;
+  size_t stack_size = 0u;  // Zero for the default.
+  std::string name;        // Empty to keep the default name.
+
+  LifetimePlacement& CPUs(std::vector<int> value) {
+    cpus = std::move(value);
+    return *this;
+  }
+  LifetimePlacement& NUMANode(int value) {
+    numa_node = value;
+    return *this;
+  }
+  LifetimePlacement& Nice(int value) {
+    has_nice = true;
+    nice = value;
+    return *this;
+  }
+  LifetimePlacement& Sched(int policy, int priority = 0) {
+    sched_policy = policy;
+    sched_priority = priority;
+    return *this;
+  }
+  LifetimePlacement& StackSize(size_t value) {
+    stack_size = value;
+    return *this;
+  }
+  LifetimePlacement& Name(std::string value) {
+    name = std::move(value);
+    return *this;
+  }
+
+  // Parses the "0-3,8,10-11" format of `/sys/devices/system/node/node*/cpulist`.
+  static std::vector<int> ParseCPUList(std::string const& s) {
+    std::vector<int> result;
+    std::istringstream is(s);
+    std::string range;
+    while (std::getline(is, range, ',')) {
+      int a;
+      int b;
+      int const n = std::sscanf(range.c_str(), "%d-%d", &a, &b);
+      if (n == 1) {
+        result.push_back(a);
+      } else if (n == 2) {
+        for (int i = a; i <= b; ++i) {
+          result.push_back(i);
+        }
+      }
+    }
+    return result;
+  }
+
+  static std::vector<int> NUMANodeCPUs(int node) {
+    std::ifstream fi(current::strings::Printf("/sys/devices/system/node/node%d/cpulist", node));
+    std::string s;
+    std::getline(fi, s);
+    return ParseCPUList(s);
+  }
+
+  // Applies everything but the stack size to the calling thread.
+  void ApplyToCurrentThread() const {
+    auto& mgr = LIFETIME_MANAGER_SINGLETON_IMPL();
+    if (!name.empty()) {
+#ifdef __APPLE__
+      ::pthread_setname_np(name.substr(0, 15).c_str());
+#else
+      ::pthread_setname_np(::pthread_self(), name.substr(0, 15).c_str());
+#endif
+    }
+#ifdef __linux__
+    std::vector<int> effective_cpus = cpus;
+    if (numa_node >= 0) {
+      std::vector<int> const node_cpus = NUMANodeCPUs(numa_node);
+      if (node_cpus.empty()) {
+        mgr.Log(current::strings::Printf("No CPUs found for NUMA node %d.", numa_node));
+      } else if (effective_cpus.empty()) {
+        effective_cpus = node_cpus;
+      } else {
+        std::vector<int> intersection;
+        for (int cpu : effective_cpus) {
+          if (std::find(node_cpus.begin(), node_cpus.end(), cpu) != node_cpus.end()) {
+            intersection.push_back(cpu);
+          }
+        }
+        if (intersection.empty()) {
+          mgr.Log(current::strings::Printf("None of the CPUs of thread `%s` are on NUMA node %d, not pinning it.",
+                                           name.c_str(),
+                                           numa_node));
+        }
+        effective_cpus = std::move(intersection);
+      }
+      // `set_mempolicy(MPOL_PREFERRED, ...)`, via `syscall()` to not depend on `libnuma`.
+      constexpr static int kMPOL_PREFERRED = 1;
+      unsigned long nodemask[16] = {0ul};
+      size_t const bits_per_word = 8u * sizeof(unsigned long);
+      if (static_cast<size_t>(numa_node) < bits_per_word * 16u) {
+        nodemask[numa_node / bits_per_word] |= 1ul << (numa_node % bits_per_word);
+        if (::syscall(SYS_set_mempolicy, kMPOL_PREFERRED, nodemask, bits_per_word * 16u)) {
+          mgr.Log(current::strings::Printf("Can not prefer the memory of NUMA node %d.", numa_node));
+        }
+      }
+    }
+    if (!effective_cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int cpu : effective_cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+          CPU_SET(cpu, &set);
+        }
+      }
+      if (::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set)) {
+        mgr.Log("Can not set the CPU affinity of thread `" + name + "`.");
+      }
+    }
+    if (has_nice) {
+      // On Linux the nice value is per thread, for `PRIO_PROCESS` and the thread ID.
+      if (::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), nice)) {
+        mgr.Log(current::strings::Printf("Can not set the nice value of %d for thread `%s`.", nice, name.c_str()));
+      }
+    }
+#else
+    if (!cpus.empty() || numa_node >= 0 || has_nice) {
+      mgr.Log("The CPU sets, the NUMA nodes, and the nice values are not supported on this platform, ignoring.");
+    }
+#endif
+    if (sched_policy >= 0) {
+      sched_param param;
+      param.sched_priority = sched_priority;
+      if (::pthread_setschedparam(::pthread_self(), sched_policy, &param)) {
+        mgr.Log(current::strings::Printf("Can not set the scheduling policy %d with priority %d for thread `%s`.",
+                                         sched_policy,
+                                         sched_priority,
+                                         name.c_str()));
+      }
+    }
+  }
+};
+
+class LifetimePlacementProfiles final {
+ public:
+  void Set(std::string const& profile, LifetimePlacement placement) {
+    std::lock_guard lock(mutex_);
+    profiles_[profile] = std::move(placement);
+  }
+
+  LifetimePlacement Get(std::string const& profile) const {
+    std::lock_guard lock(mutex_);
+    auto const cit = profiles_.find(profile);
+    if (cit == profiles_.end()) {
+      throw LifetimePlacementException("No placement profile `" + profile + "`.");
+    }
+    return cit->second;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::map<std::string, LifetimePlacement> profiles_;
+};
+
+#define LIFETIME_PLACEMENT_PROFILE_SET(profile, placement) \
+  current::Singleton<LifetimePlacementProfiles>().Set(profile, placement)
+#define LIFETIME_PLACEMENT_PROFILE(profile) current::Singleton<LifetimePlacementProfiles>().Get(profile)
+
+// Same as `LIFETIME_TRACKED_THREAD`, on a thread with the placement applied.
+template <typename F>
+void LIFETIME_TRACKED_THREAD_PLACED(std::string desc, LifetimePlacement const& placement, F&& body) {
+  current::WaitableAtomic<bool> ready_to_go(false);
+  LIFETIME_MANAGER_SINGLETON_IMPL().EmplaceThreadWithStackSizeImpl(
+      placement.stack_size,
+      [moved_desc = std::move(desc), placement, moved_body = std::forward<F>(body), &ready_to_go]() mutable {
+        auto& mgr = LIFETIME_MANAGER_SINGLETON_IMPL();
+        size_t const id = mgr.TrackingAdd(moved_desc, __FILE__, __LINE__);
+        placement.ApplyToCurrentThread();
+        ready_to_go.SetValue(true);
+        moved_body();
+        mgr.TrackingRemove(id);
+      });
+  ready_to_go.Wait([](bool b) { return b; });
+}
+
+// Same as `CreateLifetimeTrackedInstance`, with the instance constructed, living, and destructed in a placed thread.
+template <class T, class... ARGS>
+T& CreateLifetimeTrackedInstancePlaced(
+    LifetimePlacement const& placement, char const* file, int line, std::string const& text, ARGS&&... args) {
+  current::WaitableAtomic<T*> result(nullptr);
+  auto& mgr = LIFETIME_MANAGER_SINGLETON_IMPL();
+  mgr.EmplaceThreadWithStackSizeImpl(placement.stack_size, [&, placement]() {
+    placement.ApplyToCurrentThread();
+    size_t const id = [&]() {
+      T instance(std::forward<ARGS>(args)...);
+      size_t const id = mgr.TrackingAdd(text, file, line);
+      result.SetValue(&instance);
+      mgr.WaitUntilTimeToDie();
+      return id;
+    }();
+    mgr.TrackingRemove(id);
+  });
+  result.Wait([](T const* ptr) { return ptr != nullptr; });
+  return *result.GetValue();
+}
+
+#define LIFETIME_TRACKED_INSTANCE_PLACED(type, placement, ...) \
+  CreateLifetimeTrackedInstancePlaced<type>(placement, __FILE__, __LINE__, __VA_ARGS__)
+
+// Same as `LIFETIME_TRACKED_POPEN2`, with the child spawned from a placed helper thread, so that it inherits the
+// CPU set, the NUMA memory policy, the nice value, and the scheduling policy. The callbacks run as they would anyway.
+template <class T_POPEN2_RUNTIME>
+inline int LifetimeTrackedPopen2Placed(
+    LifetimePlacement const& placement,
+    std::string const& text,
+    char const* file,
+    size_t line,
+    std::vector<std::string> const& cmdline,
+    std::function<void(const std::string&)> cb_line,
+    std::function<void(T_POPEN2_RUNTIME&)> cb_code = [](T_POPEN2_RUNTIME&) {},
+    std::vector<std::string> const& env = {}) {
+  int retval = -1;
+  // Whatever the callbacks throw is passed on to the caller, as it would be without the helper thread.
+  std::exception_ptr exception;
+  std::thread([&]() {
+    placement.ApplyToCurrentThread();
+    try {
+      retval = LIFETIME_TRACKED_POPEN2_IMPL<T_POPEN2_RUNTIME>(
+          text, file, line, cmdline, std::move(cb_line), std::move(cb_code), env);
+    } catch (...) {
+      exception = std::current_exception();
+    }
+  }).join();
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
+  return retval;
+}
+
+#define LIFETIME_TRACKED_POPEN2_PLACED(text, placement, ...) \
+  LifetimeTrackedPopen2Placed<Popen2Runtime>(placement, text, __FILE__, __LINE__, __VA_ARGS__)
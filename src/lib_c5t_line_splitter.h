@@ -0,0 +1,287 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define C5T_LINE_SPLITTER_X86
+#include <immintrin.h>
+#endif
+
+// NOTE: Splits the raw output of child processes into lines, the way `cb_line` wants them delivered.
+//
+// The hot loop is "find the '\n'-s", and it is vectorized: AVX2 when the CPU has it, SSE2 on any x86_64,
+// and a plain scalar loop elsewhere. The choice is made once, at runtime, so the binary stays portable.
+// A trailing '\r' is stripped from each line, so that CR/LF-terminated output yields the same lines as LF-terminated.
+//
+// The data is `read()` directly into a large reusable buffer; complete lines are reported as `std::string_view`-s
+// pointing into that buffer, and the incomplete tail is moved to the front of it before the next `read()`.
+// No per-line allocations happen unless the user asks for an `std::string`, and even then a single one is reused.
+//
+// `popen2()` does its own reading, so `LIFETIME_TRACKED_POPEN2` does not go through this. What does are the readers
+// of the raw file descriptors of the children, such as `OutputCaptureWriter::AppendFromFD()`.
+
+namespace current {
+namespace lines {
+
+enum class NewlineScannerKind : int { Scalar = 0, SSE2 = 1, AVX2 = 2 };
+
+inline char const* NewlineScannerName(NewlineScannerKind kind) {
+  switch (kind) {
+    case NewlineScannerKind::Scalar:
+      return "scalar";
+    case NewlineScannerKind::SSE2:
+      return "sse2";
+    case NewlineScannerKind::AVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+// Returns the bitmask of where the '\n'-s are within the 64 bytes starting at `p`, the lowest bit is `p[0]`.
+// Working with the mask of a whole block, not with "find the next one", is what makes short lines cheap as well.
+inline uint64_t NewlineMask64Scalar(char const* p) {
+  uint64_t mask = 0u;
+  for (int i = 0; i < 64; ++i) {
+    mask |= static_cast<uint64_t>(p[i] == '\n') << i;
+  }
+  return mask;
+}
+
+#ifdef C5T_LINE_SPLITTER_X86
+
+__attribute__((target("sse2"))) inline uint64_t NewlineMask64SSE2(char const* p) {
+  __m128i const nl = _mm_set1_epi8('\n');
+  uint64_t mask = 0u;
+  for (int i = 0; i < 4; ++i) {
+    __m128i const chunk = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 16 * i));
+    mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl)))) << (16 * i);
+  }
+  return mask;
+}
+
+__attribute__((target("avx2"))) inline uint64_t NewlineMask64AVX2(char const* p) {
+  __m256i const nl = _mm256_set1_epi8('\n');
+  __m256i const a = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+  __m256i const b = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p + 32));
+  uint32_t const ma = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)));
+  uint32_t const mb = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)));
+  return (static_cast<uint64_t>(mb) << 32) | ma;
+}
+
+#endif  // C5T_LINE_SPLITTER_X86
+
+inline bool NewlineScannerSupported(NewlineScannerKind kind) {
+  switch (kind) {
+    case NewlineScannerKind::Scalar:
+      return true;
+#ifdef C5T_LINE_SPLITTER_X86
+    case NewlineScannerKind::SSE2:
+      return __builtin_cpu_supports("sse2");
+    case NewlineScannerKind::AVX2:
+      return __builtin_cpu_supports("avx2");
+#else
+    default:
+      return false;
+#endif
+  }
+  return false;
+}
+
+inline NewlineScannerKind BestNewlineScanner() {
+  static NewlineScannerKind const best = []() {
+    if (NewlineScannerSupported(NewlineScannerKind::AVX2)) {
+      return NewlineScannerKind::AVX2;
+    } else if (NewlineScannerSupported(NewlineScannerKind::SSE2)) {
+      return NewlineScannerKind::SSE2;
+    } else {
+      return NewlineScannerKind::Scalar;
+    }
+  }();
+  return best;
+}
+
+using NewlineMask64Function = uint64_t (*)(char const*);
+
+inline NewlineMask64Function NewlineScanner(NewlineScannerKind kind) {
+#ifdef C5T_LINE_SPLITTER_X86
+  if (kind == NewlineScannerKind::AVX2 && NewlineScannerSupported(kind)) {
+    return NewlineMask64AVX2;
+  } else if (kind == NewlineScannerKind::SSE2 && NewlineScannerSupported(kind)) {
+    return NewlineMask64SSE2;
+  }
+#endif
+  static_cast<void>(kind);
+  return NewlineMask64Scalar;
+}
+
+class LineSplitter final {
+ public:
+  // 64KB `read()`-s amortize the syscall cost well, and a pipe buffer is 64KB on Linux anyway.
+  constexpr static size_t kDefaultReadSize = 64 * 1024;
+
+  explicit LineSplitter(size_t read_size = kDefaultReadSize,
+                        NewlineScannerKind kind = BestNewlineScanner(),
+                        bool strip_cr = true)
+      : read_size_(read_size ? read_size : kDefaultReadSize),
+        newline_mask_(NewlineScanner(kind)),
+        strip_cr_(strip_cr),
+        buffer_(read_size_ * 2) {}
+
+  // Where to `read()` the next chunk of data into. At least `read_size` bytes are always available.
+  // Call it before `WritableSize()`, as it may compact or grow the buffer, and never in the same full-expression.
+  char* WritableBegin() {
+    MakeRoomForRead();
+    return &buffer_[end_];
+  }
+  size_t WritableSize() const { return buffer_.size() - end_; }
+
+  // Marks `n` bytes past `WritableBegin()` as filled, and calls `f(std::string_view)` for each complete line.
+  template <class F>
+  void Commit(size_t n, F&& f) {
+    end_ += n;
+    char const* const base = buffer_.data();
+    char const* const end = base + end_;
+    char const* line_begin = base + begin_;
+    char const* p = base + scan_from_;
+    while (end - p >= 64) {
+      for (uint64_t mask = newline_mask_(p); mask; mask &= mask - 1u) {
+        char const* const nl = p + __builtin_ctzll(mask);
+        EmitLine(line_begin, nl, f);
+        line_begin = nl + 1;
+      }
+      p += 64;
+    }
+    for (; p != end; ++p) {
+      if (*p == '\n') {
+        EmitLine(line_begin, p, f);
+        line_begin = p + 1;
+      }
+    }
+    begin_ = static_cast<size_t>(line_begin - base);
+    scan_from_ = end_;
+  }
+
+  // Copies `data` into the internal buffer. Handy when the bytes did not come from a `read()`.
+  template <class F>
+  void Feed(char const* data, size_t size, F&& f) {
+    while (size) {
+      char* const dst = WritableBegin();
+      size_t const n = std::min(size, WritableSize());
+      std::memcpy(dst, data, n);
+      Commit(n, f);
+      data += n;
+      size -= n;
+    }
+  }
+
+  // Reports the last, not newline-terminated, line, if any.
+  template <class F>
+  void Flush(F&& f) {
+    if (end_ != begin_) {
+      EmitLine(buffer_.data() + begin_, buffer_.data() + end_, f);
+    }
+    begin_ = end_ = scan_from_ = 0;
+  }
+
+  // Performs a single `read()`. Returns `false` on EOF or on error, having flushed the last line.
+  template <class F>
+  bool ReadOnce(int fd, F&& f) {
+    while (true) {
+      char* const dst = WritableBegin();
+      ssize_t const n = ::read(fd, dst, WritableSize());
+      if (n > 0) {
+        Commit(static_cast<size_t>(n), f);
+        return true;
+      } else if (n < 0 && errno == EINTR) {
+        continue;
+      } else {
+        Flush(f);
+        return false;
+      }
+    }
+  }
+
+  template <class F>
+  void ReadAll(int fd, F&& f) {
+    while (ReadOnce(fd, f)) {
+    }
+  }
+
+ private:
+  size_t const read_size_;
+  NewlineMask64Function const newline_mask_;
+  bool const strip_cr_;
+  std::vector<char> buffer_;
+  size_t begin_ = 0;      // The beginning of the incomplete line.
+  size_t end_ = 0;        // The end of the data read so far.
+  size_t scan_from_ = 0;  // Everything in `[begin_, scan_from_)` is already known to not contain '\n'.
+
+  template <class F>
+  void EmitLine(char const* b, char const* e, F&& f) {
+    if (strip_cr_ && e != b && e[-1] == '\r') {
+      --e;
+    }
+    f(std::string_view(b, static_cast<size_t>(e - b)));
+  }
+
+  void MakeRoomForRead() {
+    if (buffer_.size() - end_ >= read_size_) {
+      return;
+    }
+    size_t const pending = end_ - begin_;
+    if (begin_ && pending + read_size_ <= buffer_.size()) {
+      // Move the incomplete line to the front, so that lines always stay contiguous in memory.
+      std::memmove(buffer_.data(), buffer_.data() + begin_, pending);
+    } else {
+      // A single line is longer than the buffer can fit, so grow it.
+      std::vector<char> grown(std::max(buffer_.size() * 2, pending + read_size_));
+      std::memcpy(grown.data(), buffer_.data() + begin_, pending);
+      buffer_.swap(grown);
+    }
+    scan_from_ -= begin_;
+    end_ = pending;
+    begin_ = 0;
+  }
+};
+
+// Adapts an `std::function<void(std::string const&)>`-style `cb_line` to the `std::string_view` callback.
+// The very same `std::string` is reused for every line, so its capacity is only ever grown a few times.
+template <class F>
+class ReusedStringLineCallback final {
+ public:
+  explicit ReusedStringLineCallback(F& f) : f_(f) {}
+  void operator()(std::string_view line) {
+    line_.assign(line.data(), line.size());
+    f_(line_);
+  }
+
+ private:
+  F& f_;
+  std::string line_;
+};
+
+// Reads everything from `fd` until EOF, calling `cb_line(std::string const&)` for each line.
+template <class F>
+inline void ReadLinesFromFD(int fd, F&& cb_line, LineSplitter& splitter) {
+  ReusedStringLineCallback<std::remove_reference_t<F>> adapter(cb_line);
+  splitter.ReadAll(fd, adapter);
+}
+
+template <class F>
+inline void ReadLinesFromFD(int fd, F&& cb_line) {
+  LineSplitter splitter;
+  ReadLinesFromFD(fd, std::forward<F>(cb_line), splitter);
+}
+
+}  // namespace lines
+}  // namespace current
@@ -0,0 +1,438 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bricks/strings/printf.h"
+#include "bricks/time/chrono.h"
+
+#include "lib_c5t_lifetime_manager.h"
+#include "lib_c5t_line_splitter.h"
+
+// NOTE: A capture sink to keep the full output of a child process on disk, cheaply.
+//
+// The output goes into fixed-size segment files in a per-child directory. Each segment is preallocated and `mmap()`-ed,
+// so appending a line is a `memcpy()` into the page cache. Every segment starts with a header that holds the number
+// of committed bytes and a sparse index of (offset, timestamp) pairs, one per `index_every_bytes` of output.
+//
+// Readers, in this process or in any other one, map the very same files read-only, and see everything up to the
+// committed size, which the writer publishes with release semantics after the bytes are in place.
+// Readers get `std::string_view`-s into the mappings, no copies and no parsing involved.
+//
+// Once a segment is full it is sealed and trimmed to its actual size, and the next one is started.
+// Only the `max_segments` most recent segments are kept. A line never spans two segments;
+// a single line that does not fit into an empty segment is truncated.
+//
+// One directory is for one writer at a time: the writer holds an exclusive `flock()` on the ".lock" file in it,
+// and throws if another writer, in this process or in any other one, already holds it.
+//
+// The writer takes the lines as `std::string_view`-s. `AppendFromFD()` feeds it straight from the `read()` buffer
+// of the line splitter, with no per-line allocations at all. `LIFETIME_TRACKED_POPEN2_CAPTURED` can not do that,
+// as `popen2()` only hands out its lines as `std::string`-s, so for it the capture is one extra `memcpy()` per line.
+
+struct OutputCaptureConfig final {
+  std::string directory;
+  size_t segment_size = 64u << 20;
+  size_t max_segments = 16u;
+  size_t index_every_bytes = 64u << 10;
+};
+
+struct OutputCaptureException final : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+struct OutputCaptureIndexEntry final {
+  uint64_t offset;
+  int64_t t_us;
+};
+
+struct OutputCaptureSegmentHeader final {
+  constexpr static char const* kMagic = "C5TCAPT1";
+
+  char magic[8];
+  uint64_t header_size;  // The data starts at this offset into the file.
+  uint64_t data_capacity;
+  uint64_t index_capacity;
+  std::atomic<uint64_t> committed;  // Bytes of data readable by the readers.
+  std::atomic<uint64_t> index_size;
+  std::atomic<uint64_t> sealed;
+
+  OutputCaptureIndexEntry* Index() { return reinterpret_cast<OutputCaptureIndexEntry*>(this + 1); }
+  OutputCaptureIndexEntry const* Index() const { return reinterpret_cast<OutputCaptureIndexEntry const*>(this + 1); }
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared-memory atomics must be lock-free.");
+
+inline std::string OutputCaptureSegmentFileName(std::string const& directory, uint64_t segment_number) {
+  return directory + current::strings::Printf("/%08llu.c5t_capture", static_cast<unsigned long long>(segment_number));
+}
+
+// Returns the numbers of the segments present in `directory`, in increasing order.
+inline std::vector<uint64_t> OutputCaptureListSegments(std::string const& directory) {
+  std::vector<uint64_t> result;
+  if (DIR* dir = ::opendir(directory.c_str())) {
+    while (struct dirent* e = ::readdir(dir)) {
+      char const* const suffix = ".c5t_capture";
+      size_t const n = std::strlen(e->d_name);
+      size_t const k = std::strlen(suffix);
+      if (n > k && !std::strcmp(e->d_name + n - k, suffix)) {
+        result.push_back(std::strtoull(e->d_name, nullptr, 10));
+      }
+    }
+    ::closedir(dir);
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+class OutputCaptureMappedSegment final {
+ public:
+  OutputCaptureMappedSegment(std::string const& file_name, bool writable, size_t file_size = 0u) {
+    int const fd = ::open(file_name.c_str(), writable ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+    if (fd < 0) {
+      throw OutputCaptureException("Can not open `" + file_name + "`.");
+    }
+    if (writable) {
+#ifdef __linux__
+      // Actually reserve the blocks, so that running out of disk space is not a `SIGBUS` on some `memcpy()` later.
+      bool const ok = !::posix_fallocate(fd, 0, static_cast<off_t>(file_size));
+#else
+      bool const ok = !::ftruncate(fd, static_cast<off_t>(file_size));
+#endif
+      if (!ok) {
+        ::close(fd);
+        throw OutputCaptureException("Can not preallocate `" + file_name + "`.");
+      }
+      size_ = file_size;
+    } else {
+      struct stat st;
+      if (::fstat(fd, &st) || static_cast<size_t>(st.st_size) < sizeof(OutputCaptureSegmentHeader)) {
+        ::close(fd);
+        throw OutputCaptureException("Not a capture segment: `" + file_name + "`.");
+      }
+      size_ = static_cast<size_t>(st.st_size);
+    }
+    void* const p = ::mmap(nullptr, size_, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      throw OutputCaptureException("Can not `mmap()` `" + file_name + "`.");
+    }
+    data_ = static_cast<char*>(p);
+    if (!writable && (std::memcmp(Header().magic, OutputCaptureSegmentHeader::kMagic, 8) ||
+                      Header().header_size + Header().committed.load(std::memory_order_acquire) > size_)) {
+      ::munmap(data_, size_);
+      throw OutputCaptureException("Not a capture segment: `" + file_name + "`.");
+    }
+  }
+
+  OutputCaptureMappedSegment(OutputCaptureMappedSegment const&) = delete;
+  OutputCaptureMappedSegment& operator=(OutputCaptureMappedSegment const&) = delete;
+
+  ~OutputCaptureMappedSegment() { ::munmap(data_, size_); }
+
+  OutputCaptureSegmentHeader& Header() { return *reinterpret_cast<OutputCaptureSegmentHeader*>(data_); }
+  OutputCaptureSegmentHeader const& Header() const {
+    return *reinterpret_cast<OutputCaptureSegmentHeader const*>(data_);
+  }
+
+  char* Data() { return data_ + Header().header_size; }
+  char const* Data() const { return data_ + Header().header_size; }
+
+  // The committed part of the data, safe to read concurrently with the writer.
+  std::string_view Committed() const {
+    return std::string_view(Data(), Header().committed.load(std::memory_order_acquire));
+  }
+
+ private:
+  char* data_ = nullptr;
+  size_t size_ = 0u;
+};
+
+class OutputCaptureWriter final {
+ public:
+  explicit OutputCaptureWriter(OutputCaptureConfig config) : config_(std::move(config)) {
+    if (config_.directory.empty()) {
+      throw OutputCaptureException("The capture directory must be provided.");
+    }
+    if (!config_.max_segments) {
+      throw OutputCaptureException("The capture must keep at least one segment.");
+    }
+    ::mkdir(config_.directory.c_str(), 0755);
+    std::string const lock_file_name = config_.directory + "/.lock";
+    lock_fd_ = ::open(lock_file_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd_ < 0) {
+      throw OutputCaptureException("Can not open `" + lock_file_name + "`.");
+    }
+    if (::flock(lock_fd_, LOCK_EX | LOCK_NB)) {
+      ::close(lock_fd_);
+      throw OutputCaptureException("Already capturing into `" + config_.directory + "`, use one directory per child.");
+    }
+    for (uint64_t n : OutputCaptureListSegments(config_.directory)) {
+      next_segment_number_ = n + 1u;  // Continue the sequence if the directory is reused.
+    }
+    size_t const page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    index_capacity_ = config_.segment_size / std::max(config_.index_every_bytes, size_t(1)) + 1u;
+    header_size_ =
+        (sizeof(OutputCaptureSegmentHeader) + index_capacity_ * sizeof(OutputCaptureIndexEntry) + page - 1u) / page *
+        page;
+    data_capacity_ = std::max(config_.segment_size, header_size_ + page) - header_size_;
+  }
+
+  OutputCaptureWriter(OutputCaptureWriter const&) = delete;
+  OutputCaptureWriter& operator=(OutputCaptureWriter const&) = delete;
+
+  ~OutputCaptureWriter() {
+    std::lock_guard lock(mutex_);
+    SealCurrentSegment();
+    ::close(lock_fd_);  // Releases the `flock()`.
+  }
+
+  std::string const& Directory() const { return config_.directory; }
+
+  // Appends `line` followed by '\n'. Thread-safe.
+  void AppendLine(std::string_view line, std::chrono::microseconds t = current::time::Now()) {
+    std::lock_guard lock(mutex_);
+    size_t const n = std::min(line.length(), data_capacity_ - 1u);
+    if (!segment_ || segment_->Header().committed.load(std::memory_order_relaxed) + n + 1u > data_capacity_) {
+      StartNextSegment();
+    }
+    OutputCaptureSegmentHeader& header = segment_->Header();
+    uint64_t const offset = header.committed.load(std::memory_order_relaxed);
+    if (offset == 0u || offset - last_indexed_offset_ >= config_.index_every_bytes) {
+      uint64_t const i = header.index_size.load(std::memory_order_relaxed);
+      if (i < header.index_capacity) {
+        header.Index()[i] = OutputCaptureIndexEntry{offset, static_cast<int64_t>(t.count())};
+        header.index_size.store(i + 1u, std::memory_order_release);
+        last_indexed_offset_ = offset;
+      }
+    }
+    char* const dst = segment_->Data() + offset;
+    std::memcpy(dst, line.data(), n);
+    dst[n] = '\n';
+    header.committed.store(offset + n + 1u, std::memory_order_release);
+  }
+
+  // Captures what is `read()` from `fd` until EOF, the bytes as they are, except that the last line gets its '\n'.
+  // The lines are passed to the optional `f(std::string_view)` as well, valid only for the duration of the call.
+  template <class F>
+  void AppendFromFD(int fd, F&& f) {
+    current::lines::LineSplitter splitter(
+        current::lines::LineSplitter::kDefaultReadSize, current::lines::BestNewlineScanner(), false);
+    splitter.ReadAll(fd, [this, &f](std::string_view line) {
+      AppendLine(line);
+      f(line);
+    });
+  }
+
+  void AppendFromFD(int fd) {
+    AppendFromFD(fd, [](std::string_view) {});
+  }
+
+ private:
+  OutputCaptureConfig const config_;
+  size_t index_capacity_;
+  size_t header_size_;
+  size_t data_capacity_;
+  std::mutex mutex_;
+  uint64_t next_segment_number_ = 0u;
+  uint64_t current_segment_number_ = 0u;
+  uint64_t last_indexed_offset_ = 0u;
+  std::unique_ptr<OutputCaptureMappedSegment> segment_;
+  int lock_fd_ = -1;
+
+  void SealCurrentSegment() {
+    if (segment_) {
+      size_t const used = header_size_ + segment_->Header().committed.load(std::memory_order_relaxed);
+      segment_->Header().sealed.store(1u, std::memory_order_release);
+      segment_ = nullptr;
+      // Give the unused preallocated space back. Readers never look past the committed size, so this is safe.
+      ::truncate(OutputCaptureSegmentFileName(config_.directory, current_segment_number_).c_str(),
+                 static_cast<off_t>(used));
+    }
+  }
+
+  void StartNextSegment() {
+    SealCurrentSegment();
+    current_segment_number_ = next_segment_number_++;
+    segment_ = std::make_unique<OutputCaptureMappedSegment>(
+        OutputCaptureSegmentFileName(config_.directory, current_segment_number_), true, header_size_ + data_capacity_);
+    OutputCaptureSegmentHeader& header = segment_->Header();
+    std::memcpy(header.magic, OutputCaptureSegmentHeader::kMagic, 8);
+    header.header_size = header_size_;
+    header.data_capacity = data_capacity_;
+    header.index_capacity = index_capacity_;
+    header.committed.store(0u, std::memory_order_relaxed);
+    header.index_size.store(0u, std::memory_order_relaxed);
+    header.sealed.store(0u, std::memory_order_release);
+    last_indexed_offset_ = 0u;
+    // The readers keep their own mappings, so it is safe to remove the files they may still be reading.
+    if (current_segment_number_ >= config_.max_segments) {
+      for (uint64_t n : OutputCaptureListSegments(config_.directory)) {
+        if (n + config_.max_segments <= current_segment_number_) {
+          ::unlink(OutputCaptureSegmentFileName(config_.directory, n).c_str());
+        }
+      }
+    }
+  }
+};
+
+// What the reader returns: the views into the mapped segments, valid for as long as this object is alive.
+struct OutputCaptureView final {
+  std::vector<std::string_view> chunks;
+  std::vector<std::shared_ptr<OutputCaptureMappedSegment const>> keepalive;
+
+  size_t TotalBytes() const {
+    size_t result = 0u;
+    for (auto const& chunk : chunks) {
+      result += chunk.length();
+    }
+    return result;
+  }
+
+  template <class F>
+  void ForEachLine(F&& f) const {
+    // Lines never span segments, so each chunk can be split on its own, with no copying.
+    for (auto const& chunk : chunks) {
+      char const* b = chunk.data();
+      char const* const e = b + chunk.length();
+      while (b != e) {
+        char const* const nl = static_cast<char const*>(std::memchr(b, '\n', static_cast<size_t>(e - b)));
+        char const* const line_end = nl ? nl : e;
+        f(std::string_view(b, static_cast<size_t>(line_end - b)));
+        b = nl ? nl + 1 : e;
+      }
+    }
+  }
+};
+
+class OutputCaptureReader final {
+ public:
+  explicit OutputCaptureReader(std::string directory) : directory_(std::move(directory)) {}
+
+  // Up to the last `max_bytes` of the output, starting from a line boundary.
+  OutputCaptureView Tail(size_t max_bytes) {
+    OutputCaptureView result;
+    auto const segments = Segments();
+    for (auto it = segments.rbegin(); it != segments.rend() && max_bytes; ++it) {
+      std::string_view data = (*it)->Committed();
+      if (data.length() > max_bytes) {
+        data.remove_prefix(data.length() - max_bytes);
+        size_t const nl = data.find('\n');
+        data.remove_prefix(nl == std::string_view::npos ? data.length() : nl + 1u);
+        max_bytes = 0u;
+      } else {
+        max_bytes -= data.length();
+      }
+      result.chunks.insert(result.chunks.begin(), data);
+      result.keepalive.push_back(*it);
+    }
+    return result;
+  }
+
+  // The output starting from the last indexed point at or before `t`, so it includes everything since `t`.
+  OutputCaptureView Since(std::chrono::microseconds t) {
+    OutputCaptureView result;
+    auto const segments = Segments();
+    // Find the most recent segment that started at or before `t`, then use its sparse index.
+    size_t first = 0u;
+    for (size_t i = 0u; i < segments.size(); ++i) {
+      auto const& header = segments[i]->Header();
+      if (header.index_size.load(std::memory_order_acquire) && header.Index()[0].t_us <= t.count()) {
+        first = i;
+      }
+    }
+    for (size_t i = first; i < segments.size(); ++i) {
+      std::string_view data = segments[i]->Committed();
+      if (i == first) {
+        auto const& header = segments[i]->Header();
+        uint64_t const n = header.index_size.load(std::memory_order_acquire);
+        OutputCaptureIndexEntry const* const index = header.Index();
+        auto const cit = std::upper_bound(
+            index, index + n, t.count(), [](int64_t v, OutputCaptureIndexEntry const& e) { return v < e.t_us; });
+        if (cit != index) {
+          data.remove_prefix(std::min(static_cast<size_t>(cit[-1].offset), data.length()));
+        }
+      }
+      result.chunks.push_back(data);
+      result.keepalive.push_back(segments[i]);
+    }
+    return result;
+  }
+
+ private:
+  std::string const directory_;
+  std::map<uint64_t, std::shared_ptr<OutputCaptureMappedSegment const>> mapped_;
+
+  // Maps the new segments, keeps the existing mappings, and forgets the deleted ones.
+  // NOTE: An existing mapping stays valid when the writer trims the segment, as it is never read past
+  //       the committed size, and the committed size is never past what the trimmed file keeps.
+  std::vector<std::shared_ptr<OutputCaptureMappedSegment const>> Segments() {
+    std::map<uint64_t, std::shared_ptr<OutputCaptureMappedSegment const>> next;
+    for (uint64_t n : OutputCaptureListSegments(directory_)) {
+      auto const cit = mapped_.find(n);
+      if (cit != mapped_.end()) {
+        next[n] = cit->second;
+      } else {
+        try {
+          next[n] = std::make_shared<OutputCaptureMappedSegment const>(OutputCaptureSegmentFileName(directory_, n),
+                                                                       false);
+        } catch (OutputCaptureException const&) {
+          // Deleted or not yet initialized by the writer, either way nothing to read from it.
+        }
+      }
+    }
+    mapped_ = std::move(next);
+    std::vector<std::shared_ptr<OutputCaptureMappedSegment const>> result;
+    for (auto const& e : mapped_) {
+      result.push_back(e.second);
+    }
+    return result;
+  }
+};
+
+// Same as `LIFETIME_TRACKED_POPEN2`, but the output is also captured into `capture.directory`.
+// The `cb_line` can be `nullptr` if capturing is all that is needed. Throws if `capture.directory` is in use.
+template <class T_POPEN2_RUNTIME>
+inline int LIFETIME_TRACKED_POPEN2_CAPTURED_IMPL(
+    std::string const& text,
+    char const* file,
+    size_t line,
+    OutputCaptureConfig const& capture,
+    std::vector<std::string> const& cmdline,
+    std::function<void(const std::string&)> cb_line,
+    std::function<void(T_POPEN2_RUNTIME&)> cb_code = [](T_POPEN2_RUNTIME&) {},
+    std::vector<std::string> const& env = {}) {
+  OutputCaptureWriter writer(capture);
+  return LIFETIME_TRACKED_POPEN2_IMPL<T_POPEN2_RUNTIME>(
+      text,
+      file,
+      line,
+      cmdline,
+      [&writer, moved_cb_line = std::move(cb_line)](std::string const& s) {
+        writer.AppendLine(s);
+        if (moved_cb_line) {
+          moved_cb_line(s);
+        }
+      },
+      std::move(cb_code),
+      env);
+}
+
+#define LIFETIME_TRACKED_POPEN2_CAPTURED(text, capture, ...) \
+  LIFETIME_TRACKED_POPEN2_CAPTURED_IMPL<Popen2Runtime>(text, __FILE__, __LINE__, capture, __VA_ARGS__)
@@ -0,0 +1,390 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bricks/strings/printf.h"
+#include "bricks/sync/waitable_atomic.h"
+
+#include "lib_c5t_lifetime_manager.h"
+
+// NOTE: Memoization for the `LIFETIME_TRACKED_POPEN2` calls that are pure functions of their inputs.
+//
+// The key is the hash of the command line, the environment, and the bytes written into the child's stdin.
+// The result is the exit code and the output lines, which are replayed through the very same `cb_line` on a hit.
+// The results are kept in memory, in an LRU bounded by `max_memory_bytes`, and optionally on disk, one file per key.
+// The files also keep what the key is the hash of, and are only used if it matches, so that neither a hash collision
+// nor a file left by some other version of the command is mistaken for the result. A file that is corrupt or cut
+// short is just a miss.
+//
+// Concurrent identical requests are deduplicated: only the first one spawns the child, the others wait for it
+// and then replay its output. Only the successful runs are cached, and nothing is cached once termination starts,
+// as the output of a child killed halfway through is not the result of the command.
+//
+// It is up to the user to only use this for deterministic commands.
+
+struct Popen2CacheConfig final {
+  size_t max_memory_bytes = 64u << 20;
+  std::string directory;  // Empty for in-memory only.
+  bool cache_nonzero_exit_codes = false;
+};
+
+struct Popen2CacheStats final {
+  size_t memory_hits = 0u;
+  size_t disk_hits = 0u;
+  size_t deduplicated = 0u;  // Waited for an identical request in flight instead of spawning a child.
+  size_t misses = 0u;
+};
+
+// A fast 128-bit non-cryptographic hash, two independently seeded 64-bit lanes over eight-byte words.
+class Popen2CacheKeyHasher final {
+ public:
+  // Each piece is length-prefixed, so that, say, {"ab", "c"} and {"a", "bc"} hash differently.
+  void Add(std::string_view piece) {
+    uint64_t const n = piece.length();
+    Mix(n);
+    char const* p = piece.data();
+    size_t remaining = piece.length();
+    while (remaining >= 8u) {
+      uint64_t k;
+      std::memcpy(&k, p, 8u);
+      Mix(k);
+      p += 8u;
+      remaining -= 8u;
+    }
+    if (remaining) {
+      uint64_t k = 0u;
+      std::memcpy(&k, p, remaining);
+      Mix(k);
+    }
+  }
+
+  std::string HexDigest() const {
+    return current::strings::Printf(
+        "%016llx%016llx", static_cast<unsigned long long>(Final(h1_)), static_cast<unsigned long long>(Final(h2_)));
+  }
+
+ private:
+  constexpr static uint64_t kMul1 = 0x9e3779b97f4a7c15ull;
+  constexpr static uint64_t kMul2 = 0xc2b2ae3d27d4eb4full;
+  uint64_t h1_ = 0x243f6a8885a308d3ull;
+  uint64_t h2_ = 0x13198a2e03707344ull;
+
+  void Mix(uint64_t k) {
+    h1_ = (h1_ ^ (k * kMul1)) * kMul2;
+    h1_ ^= h1_ >> 29;
+    h2_ = (h2_ + (k ^ (k >> 31))) * kMul1;
+    h2_ ^= h2_ >> 32;
+  }
+
+  static uint64_t Final(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+  }
+};
+
+class LifetimePopen2Cache final {
+ public:
+  struct Result final {
+    int exit_code = 0;
+    std::vector<std::string> lines;
+
+    size_t MemoryFootprint() const {
+      size_t result = sizeof(Result);
+      for (auto const& line : lines) {
+        result += sizeof(std::string) + line.capacity();
+      }
+      return result;
+    }
+  };
+
+  explicit LifetimePopen2Cache(Popen2CacheConfig config = Popen2CacheConfig()) : config_(std::move(config)) {
+    if (!config_.directory.empty()) {
+      ::mkdir(config_.directory.c_str(), 0755);
+    }
+  }
+
+  // What the key is the hash of, length-prefixed, to be kept along with the result on disk.
+  static std::string KeyMaterial(std::vector<std::string> const& cmdline,
+                                 std::vector<std::string> const& env,
+                                 std::string const& input) {
+    std::string result;
+    auto const Append = [&result](std::string const& piece) {
+      result += current::ToString(piece.length());
+      result += ':';
+      result += piece;
+    };
+    Append(current::ToString(cmdline.size()));
+    for (auto const& e : cmdline) {
+      Append(e);
+    }
+    Append(current::ToString(env.size()));
+    for (auto const& e : env) {
+      Append(e);
+    }
+    Append(input);
+    return result;
+  }
+
+  static std::string Key(std::vector<std::string> const& cmdline,
+                         std::vector<std::string> const& env,
+                         std::string const& input) {
+    Popen2CacheKeyHasher hasher;
+    hasher.Add(current::ToString(cmdline.size()));
+    for (auto const& e : cmdline) {
+      hasher.Add(e);
+    }
+    hasher.Add(current::ToString(env.size()));
+    for (auto const& e : env) {
+      hasher.Add(e);
+    }
+    hasher.Add(input);
+    return hasher.HexDigest();
+  }
+
+  // Same as `LIFETIME_TRACKED_POPEN2`, plus `input` is written into the stdin of the child, which is then closed.
+  template <class T_POPEN2_RUNTIME>
+  int Run(std::string const& text,
+          char const* file,
+          size_t line,
+          std::vector<std::string> const& cmdline,
+          std::function<void(const std::string&)> cb_line,
+          std::string const& input = "",
+          std::vector<std::string> const& env = {}) {
+    std::string const key = Key(cmdline, env, input);
+
+    std::shared_ptr<Flight> flight;
+    bool leader = false;
+    std::shared_ptr<Result const> const cached = state_.MutableUse([&](State& state) -> std::shared_ptr<Result const> {
+      auto const cit = state.lru_index.find(key);
+      if (cit != state.lru_index.end()) {
+        ++state.stats.memory_hits;
+        state.lru.splice(state.lru.begin(), state.lru, cit->second.lru_position);
+        return cit->second.result;
+      }
+      auto const cit_flight = state.in_flight.find(key);
+      if (cit_flight != state.in_flight.end()) {
+        ++state.stats.deduplicated;
+        flight = cit_flight->second;
+      } else {
+        flight = std::make_shared<Flight>();
+        state.in_flight[key] = flight;
+        leader = true;
+      }
+      return nullptr;
+    });
+    if (cached) {
+      return Replay(*cached, cb_line);
+    }
+
+    if (!leader) {
+      auto& mgr = LIFETIME_MANAGER_SINGLETON_IMPL();
+      size_t const id = mgr.TrackingAdd(text, file, line);
+      flight->Wait([](FlightOutcome const& outcome) { return outcome.done; });
+      mgr.TrackingRemove(id);
+      std::shared_ptr<Result const> const result =
+          flight->ImmutableUse([](FlightOutcome const& outcome) { return outcome.result; });
+      if (!result) {
+        // The leader has thrown, the error is its own, so try again, likely becoming the leader this time.
+        return Run<T_POPEN2_RUNTIME>(text, file, line, cmdline, std::move(cb_line), input, env);
+      }
+      return Replay(*result, cb_line);
+    }
+
+    // The leader: look on disk, and, failing that, run the child for real, streaming its output as it goes.
+    // The guard publishes the outcome and forgets the in-flight entry on every path, so that if `cb_line` or
+    // `popen2()` throws the followers are not left waiting forever; they get no result, and retry by themselves.
+    std::shared_ptr<Result const> result;
+    bool cacheable = false;
+    struct LeaderGuard final {
+      LifetimePopen2Cache& self;
+      std::string const& key;
+      Flight& flight;
+      std::shared_ptr<Result const> const& result;
+      bool const& cacheable;
+      ~LeaderGuard() {
+        self.state_.MutableUse([this](State& state) {
+          state.in_flight.erase(key);
+          if (cacheable) {
+            self.Insert(state, key, result);
+          }
+        });
+        flight.MutableUse([this](FlightOutcome& outcome) {
+          outcome.done = true;
+          outcome.result = result;
+        });
+      }
+    } const guard{*this, key, *flight, result, cacheable};
+
+    std::string const key_material = config_.directory.empty() ? std::string() : KeyMaterial(cmdline, env, input);
+    result = LoadFromDisk(key, key_material);
+    if (result) {
+      state_.MutableUse([](State& state) { ++state.stats.disk_hits; });
+      Replay(*result, cb_line);
+      cacheable = true;
+    } else {
+      state_.MutableUse([](State& state) { ++state.stats.misses; });
+      auto fresh = std::make_shared<Result>();
+      fresh->exit_code = LIFETIME_TRACKED_POPEN2_IMPL<T_POPEN2_RUNTIME>(
+          text,
+          file,
+          line,
+          cmdline,
+          [&fresh, &cb_line](std::string const& s) {
+            fresh->lines.push_back(s);
+            cb_line(s);
+          },
+          [&input](T_POPEN2_RUNTIME& ctx) {
+            if (!input.empty()) {
+              ctx.Write(input);
+            }
+            ctx.Close();
+          },
+          env);
+      bool const fresh_cacheable =
+          !LIFETIME_SHUTTING_DOWN && (fresh->exit_code == 0 || config_.cache_nonzero_exit_codes);
+      if (fresh_cacheable) {
+        SaveToDisk(key, key_material, *fresh);
+      }
+      result = std::move(fresh);
+      cacheable = fresh_cacheable;
+    }
+    return result->exit_code;
+  }
+
+  Popen2CacheStats Stats() const {
+    return state_.ImmutableUse([](State const& state) { return state.stats; });
+  }
+
+ private:
+  struct FlightOutcome final {
+    bool done = false;
+    std::shared_ptr<Result const> result;  // Stays `nullptr` if the leader has thrown.
+  };
+  using Flight = current::WaitableAtomic<FlightOutcome>;
+
+  struct Entry final {
+    std::shared_ptr<Result const> result;
+    size_t bytes;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  struct State final {
+    std::list<std::string> lru;  // The most recently used keys first.
+    std::unordered_map<std::string, Entry> lru_index;
+    size_t bytes = 0u;
+    std::unordered_map<std::string, std::shared_ptr<Flight>> in_flight;
+    Popen2CacheStats stats;
+  };
+
+  Popen2CacheConfig const config_;
+  current::WaitableAtomic<State> state_;
+
+  static int Replay(Result const& result, std::function<void(const std::string&)> const& cb_line) {
+    for (auto const& line : result.lines) {
+      cb_line(line);
+    }
+    return result.exit_code;
+  }
+
+  void Insert(State& state, std::string const& key, std::shared_ptr<Result const> result) const {
+    size_t const bytes = result->MemoryFootprint() + key.capacity();
+    if (bytes > config_.max_memory_bytes || state.lru_index.count(key)) {
+      return;
+    }
+    while (state.bytes + bytes > config_.max_memory_bytes) {
+      auto const it = state.lru_index.find(state.lru.back());
+      state.bytes -= it->second.bytes;
+      state.lru_index.erase(it);
+      state.lru.pop_back();
+    }
+    state.lru.push_front(key);
+    state.lru_index[key] = Entry{std::move(result), bytes, state.lru.begin()};
+    state.bytes += bytes;
+  }
+
+  std::string FileName(std::string const& key) const { return config_.directory + "/" + key + ".c5t_popen2_cache"; }
+
+  // The format is the header line, "C5T_POPEN2_CACHE_V2 <exit code> <number of lines> <key material length>",
+  // followed by the key material and a newline, followed by the lines.
+  std::shared_ptr<Result const> LoadFromDisk(std::string const& key, std::string const& key_material) const {
+    if (config_.directory.empty()) {
+      return nullptr;
+    }
+    std::ifstream fi(FileName(key), std::ios::binary);
+    std::string header;
+    int exit_code;
+    size_t n;
+    size_t key_material_length;
+    if (!(fi >> header >> exit_code >> n >> key_material_length) || header != "C5T_POPEN2_CACHE_V2" ||
+        fi.get() != '\n' || key_material_length != key_material.length()) {
+      return nullptr;
+    }
+    // Each line takes at least one byte, so a corrupt count is caught before anything is allocated for it.
+    std::streamoff const body_begin = fi.tellg();
+    fi.seekg(0, std::ios::end);
+    std::streamoff const body_size = fi.tellg() - body_begin;
+    fi.seekg(body_begin);
+    if (!fi || static_cast<std::streamoff>(key_material_length + 1u) > body_size ||
+        static_cast<std::streamoff>(n) > body_size - static_cast<std::streamoff>(key_material_length + 1u)) {
+      return nullptr;
+    }
+    std::string stored_key_material(key_material_length, '\0');
+    if (!fi.read(&stored_key_material[0], key_material_length) || stored_key_material != key_material ||
+        fi.get() != '\n') {
+      return nullptr;
+    }
+    auto result = std::make_shared<Result>();
+    result->exit_code = exit_code;
+    result->lines.reserve(n);
+    std::string line;
+    // A line cut short has no newline, and `std::getline()` hits the end of the file.
+    while (result->lines.size() < n && std::getline(fi, line) && !fi.eof()) {
+      result->lines.push_back(std::move(line));
+    }
+    if (result->lines.size() != n || fi.peek() != std::ifstream::traits_type::eof()) {
+      return nullptr;
+    }
+    return result;
+  }
+
+  void SaveToDisk(std::string const& key, std::string const& key_material, Result const& result) const {
+    if (config_.directory.empty()) {
+      return;
+    }
+    // Write into a temporary file first, so that a concurrent reader, maybe from another process, never sees a part.
+    std::string const file_name = FileName(key);
+    std::string const tmp_file_name = file_name + current::strings::Printf(".%d.tmp", static_cast<int>(::getpid()));
+    {
+      std::ofstream fo(tmp_file_name, std::ios::binary);
+      fo << "C5T_POPEN2_CACHE_V2 " << result.exit_code << ' ' << result.lines.size() << ' ' << key_material.length()
+         << '\n';
+      fo << key_material << '\n';
+      for (auto const& line : result.lines) {
+        fo << line << '\n';
+      }
+      if (!fo) {
+        ::unlink(tmp_file_name.c_str());
+        return;
+      }
+    }
+    ::rename(tmp_file_name.c_str(), file_name.c_str());
+  }
+};
+
+#define LIFETIME_CACHED_POPEN2(cache, text, ...) (cache).Run<Popen2Runtime>(text, __FILE__, __LINE__, __VA_ARGS__)
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bricks/sync/waitable_atomic.h"
+
+#include "lib_c5t_lifetime_manager.h"
+
+// NOTE: An admission-controlled way to run `LIFETIME_TRACKED_POPEN2`-s.
+//
+// The scheduler caps how many children run at once, globally and per tag. The rest wait in the queue, blocking the
+// callers, and show up in `LIFETIME_TRACKED_DEBUG_DUMP` as "[pending]". The queue is strictly ordered by priority,
+// and within one priority class it round-robins across callers, so that one caller's burst does not starve the others.
+// Within one caller the order is FIFO.
+//
+// Each child can also have a wall-clock deadline and an output size cap; once either is exceeded the child is killed.
+// As with the termination for `LIFETIME_TRACKED_POPEN2`, the kill can only be sent while `cb_code` runs: once it has
+// returned, the runtime context, along with the pid it would signal, may be gone. Over the output cap the lines are
+// dropped regardless, and past the deadline the outcome is `DeadlineExceeded` regardless, killed or not.
+//
+// Once `LIFETIME_SHUTTING_DOWN` flips, everything still queued is cancelled and never started.
+// The destructor cancels what is queued and waits for the running calls to return, so that the scheduler can be
+// created via `LIFETIME_TRACKED_INSTANCE`, and destroyed at termination while some calls are still in progress.
+
+enum class SpawnPriority : int { High = 0, Normal = 1, Low = 2 };
+
+struct SpawnSchedulerConfig final {
+  size_t max_concurrent = std::max(1u, std::thread::hardware_concurrency());
+  std::map<std::string, size_t> max_concurrent_per_tag;  // The tags not listed here are only limited globally.
+};
+
+struct SpawnOptions final {
+  std::string tag;
+  SpawnPriority priority = SpawnPriority::Normal;
+  std::string caller;                     // The key for fair queueing, the calling thread if empty.
+  std::chrono::milliseconds deadline{0};  // Zero for no deadline.
+  size_t max_output_bytes = 0u;           // Zero for no limit.
+};
+
+enum class SpawnOutcome : int { Completed = 0, Cancelled, DeadlineExceeded, OutputCapExceeded };
+
+struct SpawnResult final {
+  SpawnOutcome outcome;
+  int exit_code;  // Only meaningful if the child was started, i.e. not for `Cancelled`.
+};
+
+class LifetimeSpawnScheduler final {
+ public:
+  explicit LifetimeSpawnScheduler(SpawnSchedulerConfig config = SpawnSchedulerConfig())
+      : config_(std::move(config)),
+        state_(),
+        termination_scope_(LIFETIME_NOTIFY_OF_SHUTDOWN([this]() { CancelAllQueued(); })) {}
+
+  ~LifetimeSpawnScheduler() {
+    CancelAllQueued();
+    state_.Wait([](State const& state) { return state.tickets.empty(); });
+  }
+
+  template <class T_POPEN2_RUNTIME>
+  SpawnResult Run(
+      std::string const& text,
+      char const* file,
+      size_t line,
+      SpawnOptions const& options,
+      std::vector<std::string> const& cmdline,
+      std::function<void(const std::string&)> cb_line,
+      std::function<void(T_POPEN2_RUNTIME&)> cb_code = [](T_POPEN2_RUNTIME&) {},
+      std::vector<std::string> const& env = {}) {
+    auto& mgr = LIFETIME_MANAGER_SINGLETON_IMPL();
+    size_t const id = mgr.TrackingAdd(text, file, line, true);
+
+    uint64_t const ticket = Enqueue(options);
+    bool admitted = false;
+    // Frees the slot and the tracked entry even if a user callback throws, or the slot would never be given back.
+    ScopeExit const release{[&]() {
+      if (admitted) {
+        Release(ticket);
+      } else {
+        state_.MutableUse([ticket](State& state) { state.tickets.erase(ticket); });
+      }
+      mgr.TrackingRemove(id);
+    }};
+    state_.Wait([&](State const& state) {
+      TicketStatus const status = state.tickets.at(ticket).status;
+      admitted = (status == TicketStatus::Admitted);
+      return status != TicketStatus::Queued;
+    });
+    if (!admitted) {
+      return SpawnResult{SpawnOutcome::Cancelled, -1};
+    }
+
+    mgr.TrackingMarkStarted(id);
+    return RunAdmitted<T_POPEN2_RUNTIME>(options, cmdline, std::move(cb_line), std::move(cb_code), env);
+  }
+
+ private:
+  enum class TicketStatus : int { Queued = 0, Admitted, Cancelled };
+
+  struct Ticket final {
+    std::string tag;
+    TicketStatus status = TicketStatus::Queued;
+  };
+
+  // One per priority class: the FIFO per caller, and the round-robin order of the callers who have something queued.
+  struct Queue final {
+    std::deque<std::string> round_robin;
+    std::map<std::string, std::deque<uint64_t>> per_caller;
+  };
+
+  struct ScopeExit final {
+    std::function<void()> f;
+    ~ScopeExit() { f(); }
+  };
+
+  struct State final {
+    bool shutting_down = false;
+    uint64_t next_ticket = 0u;
+    std::map<uint64_t, Ticket> tickets;
+    std::array<Queue, 3> queues;
+    size_t running = 0u;
+    std::map<std::string, size_t> running_per_tag;
+  };
+
+  SpawnSchedulerConfig const config_;
+  current::WaitableAtomic<State> state_;
+  current::WaitableAtomicSubscriberScope const termination_scope_;
+
+  bool HasCapacity(State const& state, std::string const& tag) const {
+    if (state.running >= config_.max_concurrent) {
+      return false;
+    }
+    auto const cit = config_.max_concurrent_per_tag.find(tag);
+    if (cit == config_.max_concurrent_per_tag.end()) {
+      return true;
+    }
+    auto const cit_running = state.running_per_tag.find(tag);
+    return (cit_running == state.running_per_tag.end() ? 0u : cit_running->second) < cit->second;
+  }
+
+  // Admits as much as the limits allow, from the highest priority down, round-robin across the callers.
+  // A caller whose next ticket is blocked on its tag's limit is skipped, but keeps its place in the round-robin.
+  void Admit(State& state) const {
+    for (Queue& queue : state.queues) {
+      bool admitted_something = true;
+      while (admitted_something && state.running < config_.max_concurrent) {
+        admitted_something = false;
+        for (size_t i = 0u; i < queue.round_robin.size(); ++i) {
+          std::string const caller = queue.round_robin[i];
+          std::deque<uint64_t>& fifo = queue.per_caller[caller];
+          Ticket& ticket = state.tickets.at(fifo.front());
+          if (HasCapacity(state, ticket.tag)) {
+            ticket.status = TicketStatus::Admitted;
+            ++state.running;
+            ++state.running_per_tag[ticket.tag];
+            fifo.pop_front();
+            queue.round_robin.erase(queue.round_robin.begin() + static_cast<std::ptrdiff_t>(i));
+            if (fifo.empty()) {
+              queue.per_caller.erase(caller);
+            } else {
+              queue.round_robin.push_back(caller);
+            }
+            admitted_something = true;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  uint64_t Enqueue(SpawnOptions const& options) {
+    std::string caller = options.caller;
+    if (caller.empty()) {
+      std::ostringstream os;
+      os << std::this_thread::get_id();
+      caller = os.str();
+    }
+    return state_.MutableUse([&](State& state) {
+      uint64_t const ticket = state.next_ticket++;
+      state.tickets[ticket].tag = options.tag;
+      if (state.shutting_down || LIFETIME_SHUTTING_DOWN) {
+        state.tickets[ticket].status = TicketStatus::Cancelled;
+      } else {
+        Queue& queue = state.queues[static_cast<size_t>(options.priority)];
+        std::deque<uint64_t>& fifo = queue.per_caller[caller];
+        if (fifo.empty()) {
+          queue.round_robin.push_back(caller);
+        }
+        fifo.push_back(ticket);
+        Admit(state);
+      }
+      return ticket;
+    });
+  }
+
+  void Release(uint64_t ticket) {
+    state_.MutableUse([&](State& state) {
+      std::string const& tag = state.tickets.at(ticket).tag;
+      --state.running;
+      if (!--state.running_per_tag[tag]) {
+        state.running_per_tag.erase(tag);
+      }
+      state.tickets.erase(ticket);
+      if (!state.shutting_down) {
+        Admit(state);
+      }
+    });
+  }
+
+  void CancelAllQueued() {
+    state_.MutableUse([](State& state) {
+      state.shutting_down = true;
+      for (Queue& queue : state.queues) {
+        for (auto const& [_, fifo] : queue.per_caller) {
+          for (uint64_t ticket : fifo) {
+            state.tickets.at(ticket).status = TicketStatus::Cancelled;
+          }
+        }
+        queue = Queue();
+      }
+    });
+  }
+
+  template <class T_POPEN2_RUNTIME>
+  SpawnResult RunAdmitted(SpawnOptions const& options,
+                          std::vector<std::string> const& cmdline,
+                          std::function<void(const std::string&)> cb_line,
+                          std::function<void(T_POPEN2_RUNTIME&)> cb_code,
+                          std::vector<std::string> const& env) {
+    // The runtime context is only used while `cb_code` runs, hence the pointer to it is reset before it returns.
+    struct Child final {
+      T_POPEN2_RUNTIME* ctx = nullptr;
+      bool done = false;
+      SpawnOutcome outcome = SpawnOutcome::Completed;
+      size_t output_bytes = 0u;
+
+      void KillBecause(SpawnOutcome reason) {
+        if (outcome == SpawnOutcome::Completed) {
+          outcome = reason;
+        }
+        if (ctx) {
+          ctx->Kill();
+        }
+      }
+    };
+    current::WaitableAtomic<Child> child;
+
+    std::thread watchdog;
+    // Stops and joins the watchdog on the way out, also if `popen2()` or a user callback throws.
+    ScopeExit const stop_watchdog{[&child, &watchdog]() {
+      child.MutableUse([](Child& c) {
+        c.done = true;
+        c.ctx = nullptr;
+      });
+      if (watchdog.joinable()) {
+        watchdog.join();
+      }
+    }};
+    if (options.deadline.count() > 0) {
+      watchdog = std::thread([&child, deadline = options.deadline]() {
+        if (!LIFETIME_WAIT_FOR(child, [](Child const& c) { return c.done; }, deadline)) {
+          child.MutableUse([](Child& c) {
+            if (!c.done) {
+              c.KillBecause(SpawnOutcome::DeadlineExceeded);
+            }
+          });
+        }
+      });
+    }
+
+    int const exit_code = LifetimeTrackedPopen2Run<T_POPEN2_RUNTIME>(
+        cmdline,
+        [&child, max_output_bytes = options.max_output_bytes, moved_cb_line = std::move(cb_line)](
+            std::string const& s) {
+          if (max_output_bytes) {
+            bool const over_the_cap = child.MutableUse([&](Child& c) {
+              if (c.outcome == SpawnOutcome::OutputCapExceeded) {
+                return true;
+              }
+              c.output_bytes += s.length() + 1u;
+              if (c.output_bytes > max_output_bytes) {
+                c.KillBecause(SpawnOutcome::OutputCapExceeded);
+                return true;
+              }
+              return false;
+            });
+            if (over_the_cap) {
+              return;
+            }
+          }
+          moved_cb_line(s);
+        },
+        [&child, moved_cb_code = std::move(cb_code)](T_POPEN2_RUNTIME& ctx) {
+          child.MutableUse([&ctx](Child& c) {
+            c.ctx = &ctx;
+            if (c.outcome != SpawnOutcome::Completed) {
+              // The deadline or the output cap was hit before the context became available.
+              ctx.Kill();
+            }
+          });
+          // Past this point the watchdog may not touch the context, as `popen2()` may have reaped the child already,
+          // and is about to destroy the context. Also if `cb_code` throws.
+          ScopeExit const unpublish_ctx{[&child]() { child.MutableUse([](Child& c) { c.ctx = nullptr; }); }};
+          moved_cb_code(ctx);
+        },
+        env);
+
+    SpawnOutcome const outcome = child.MutableUse([](Child& c) {
+      c.done = true;
+      c.ctx = nullptr;
+      return c.outcome;
+    });
+    return SpawnResult{outcome, exit_code};
+  }
+};
+
+#define LIFETIME_SCHEDULED_POPEN2(scheduler, text, options, ...) \
+  (scheduler).Run<Popen2Runtime>(text, __FILE__, __LINE__, options, __VA_ARGS__)
@@ -0,0 +1,137 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+
+#include "popen2.h"
+#include "lib_c5t_lifetime_manager.h"
+#include "bricks/dflags/dflags.h"
+#include "bricks/strings/printf.h"
+
+DEFINE_uint32(runs, 1000, "The number of times to run each scenario.");
+DEFINE_uint32(parallel, 0, "The number of scenarios to run concurrently, zero for twice the number of cores.");
+DEFINE_uint32(quantum_ms, 5, "The quantum of the simulated clock, in milliseconds.");
+DEFINE_string(bin_dir, "", "The directory with the binaries to run, the directory of this binary if empty.");
+DEFINE_string(only, "", "If set, only run the scenarios with this string in their names.");
+
+// NOTE: Runs the crash tests and the demo many times over, all under the simulated clock, to shake out
+//       the shutdown races. Each run is its own process, as each of them ends with `exit()` or `abort()`.
+// The binaries log to stderr, so it is captured along with stdout, and shown for the first failure of each scenario.
+enum class Expect : int { Success = 0, Abort };
+
+struct Scenario final {
+  std::string name;
+  std::vector<std::string> args;
+  Expect expect;
+};
+
+// An expected abort is the one by the lifetime manager, not some crash that also happens to exit with a nonzero code.
+inline bool AsExpected(Expect expect, int exit_code, std::vector<std::string> const& output) {
+  if (expect == Expect::Success) {
+    return exit_code == 0;
+  }
+  return exit_code != 0 && std::any_of(output.begin(), output.end(), [](std::string const& line) {
+           return line.find("time to `abort()`") != std::string::npos;
+         });
+}
+
+struct ScenarioStats final {
+  std::atomic<size_t> ok{0u};
+  std::atomic<size_t> failed{0u};
+  std::mutex first_failure_mutex;
+  std::vector<std::string> first_failure_output;
+};
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  LIFETIME_MANAGER_SET_LOGGER([](std::string const& s) { std::cerr << "MGR: " << s << std::endl; });
+
+  std::string bin_dir = FLAGS_bin_dir;
+  if (bin_dir.empty()) {
+    std::string const argv0 = current::Singleton<dflags::Argv0Container>().argv_0;
+    size_t const slash = argv0.rfind(current::FileSystem::GetPathSeparator());
+    bin_dir = slash == std::string::npos ? "." : argv0.substr(0, slash);
+  }
+
+  std::vector<Scenario> scenarios;
+  for (int i = 1; i <= 5; ++i) {
+    std::string const name = "crashtest_" + current::ToString(i);
+    scenarios.push_back({name, {bin_dir + "/" + name}, Expect::Success});
+  }
+  scenarios.push_back(
+      {"demo_cooperative", {bin_dir + "/demo_lifetime_manager", "--uncooperative=false"}, Expect::Success});
+  scenarios.push_back({"demo_uncooperative", {bin_dir + "/demo_lifetime_manager"}, Expect::Abort});
+  if (!FLAGS_only.empty()) {
+    std::vector<Scenario> filtered;
+    for (auto const& s : scenarios) {
+      if (s.name.find(FLAGS_only) != std::string::npos) {
+        filtered.push_back(s);
+      }
+    }
+    scenarios = std::move(filtered);
+  }
+
+  std::vector<std::string> const env = {"C5T_LIFETIME_SIMULATED_CLOCK=" + current::ToString(FLAGS_quantum_ms)};
+  size_t const parallel = FLAGS_parallel ? FLAGS_parallel : std::max(1u, std::thread::hardware_concurrency()) * 2u;
+  size_t const total = scenarios.size() * FLAGS_runs;
+
+  std::vector<ScenarioStats> stats(scenarios.size());
+  std::atomic<size_t> next_run(0u);
+  auto const t0 = current::time::Now();
+
+  std::vector<std::thread> workers;
+  for (size_t w = 0u; w < parallel; ++w) {
+    workers.emplace_back([&]() {
+      while (!LIFETIME_SHUTTING_DOWN) {
+        size_t const run = next_run++;
+        if (run >= total) {
+          break;
+        }
+        // Interleave the scenarios, so that they all run concurrently with one another.
+        size_t const index = run % scenarios.size();
+        Scenario const& scenario = scenarios[index];
+        std::vector<std::string> output;
+        // Via `bash`, to have stderr in the very same stream, as `popen2()` only reads stdout.
+        std::vector<std::string> cmdline = {"bash", "-c", "exec \"$0\" \"$@\" 2>&1"};
+        cmdline.insert(cmdline.end(), scenario.args.begin(), scenario.args.end());
+        int const exit_code = LIFETIME_TRACKED_POPEN2(
+            scenario.name,
+            cmdline,
+            [&output](std::string const& line) { output.push_back(line); },
+            [](Popen2Runtime&) {},
+            env);
+        if (AsExpected(scenario.expect, exit_code, output)) {
+          ++stats[index].ok;
+        } else {
+          if (!stats[index].failed++) {
+            std::lock_guard lock(stats[index].first_failure_mutex);
+            output.push_back("Exit code: " + current::ToString(exit_code));
+            stats[index].first_failure_output = std::move(output);
+          }
+        }
+      }
+    });
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  auto const t1 = current::time::Now();
+  size_t total_failed = 0u;
+  for (size_t i = 0u; i < scenarios.size(); ++i) {
+    total_failed += stats[i].failed;
+    std::cout << current::strings::Printf(
+                     "%-20s ok %6d, failed %6d", scenarios[i].name.c_str(), int(stats[i].ok), int(stats[i].failed))
+              << std::endl;
+    if (stats[i].failed) {
+      std::lock_guard lock(stats[i].first_failure_mutex);
+      for (auto const& line : stats[i].first_failure_output) {
+        std::cout << "  " << line << std::endl;
+      }
+    }
+  }
+  std::cout << current::strings::Printf(
+                   "%d runs, %d in parallel, %.3lfs.", int(total), int(parallel), 1e-6 * (t1 - t0).count())
+            << std::endl;
+
+  LIFETIME_MANAGER_EXIT(total_failed ? 1 : 0);
+}